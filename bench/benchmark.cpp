@@ -0,0 +1,183 @@
+// Runs every program in the corpus on every backend and grid size and
+// prints parse time, evaluation time per pixel and the resulting frame
+// rate, after the memory a PixelFun<1024> of the backend takes. The last
+// lines summarize each backend with the geometric mean over all programs
+// and grid sizes, which is the number to watch for regressions. A few of the programs are also run as built-in effects,
+// compiled along with the benchmark, for comparison.
+//
+// Usage: pixelfun-bench [-t milliseconds] [filter]
+//
+// -t sets how long each measurement runs, 100 ms by default. Only programs
+// and backends whose name contains filter are run.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <Effect.h>
+#include <PixelFun.h>
+
+#include "corpus.h"
+
+struct GridSize {
+    size_t width;
+    size_t height;
+};
+
+static const GridSize gridSizes[] = {{8, 8}, {16, 16}, {32, 32}, {64, 64}};
+
+static const size_t maxPixels = 64 * 64;
+static_assert(maxPixels <= PixelFun<1024, FixedBackend>::maxPixels(), "Grids too large for the fixed-point backend");
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Summary {
+    double logSum;
+    size_t count;
+};
+
+static double budget = 0.1;
+static const char *filter = nullptr;
+static uint32_t checksum = 0;
+
+static bool selected(const char *backend, const char *program) {
+    return !filter || strstr(backend, filter) || strstr(program, filter);
+}
+
+// Renders frames of every grid size for budget seconds each and prints
+// how long a pixel took.
+template<typename Program>
+static void benchFrames(Program &program, const char *name, const char *backendName, double parseMicros,
+                        Summary &summary) {
+    static uint8_t frame[maxPixels];
+
+    for (const GridSize &size : gridSizes) {
+        size_t pixels = size.width * size.height;
+        size_t frames = 0;
+        float t = 0;
+        Clock::time_point start = Clock::now();
+        double elapsed;
+        do {
+            program.evalFrame(t, size.width, size.height, frame);
+            checksum += frame[frames % pixels];
+            t += 1.0f / 60.0f;
+            frames++;
+        } while ((elapsed = secondsSince(start)) < budget);
+
+        double nanosPerPixel = elapsed * 1e9 / (double) (frames * pixels);
+        char grid[16];
+        snprintf(grid, sizeof(grid), "%zux%zu", size.width, size.height);
+        printf("%-10s %-13s %-6s parse %8.2f us %9.2f ns/px %11.1f fps\n", name, backendName, grid, parseMicros,
+               nanosPerPixel, frames / elapsed);
+        summary.logSum += log(nanosPerPixel);
+        summary.count++;
+    }
+}
+
+template<typename Backend>
+static void benchBackend(const char *backendName, Summary &summary) {
+    static PixelFun<1024, Backend> pixelFun;
+    typedef PixelFun<1024, Backend> Program;
+
+    if (!filter || strstr(backendName, filter)) {
+        printf("%-10s %-13s %zu bytes/node, %zu bytes of nodes, %zu bytes of code, %zu bytes in all\n", "memory",
+               backendName, Program::nodeBytes, Program::treeBytes, Program::codeBytes, sizeof(Program));
+    }
+
+    for (const BenchProgram &program : corpus) {
+        if (!selected(backendName, program.name)) {
+            continue;
+        }
+
+        size_t parses = 0;
+        Clock::time_point start = Clock::now();
+        do {
+            if (!pixelFun.parse(program.source)) {
+                printf("%-10s %-13s parse failed at %zu: %s\n", program.name, backendName, pixelFun.errorOffset(),
+                       pixelFun.error());
+                break;
+            }
+            parses++;
+        } while (secondsSince(start) < budget / 10);
+        if (!parses) {
+            continue;
+        }
+        double parseMicros = secondsSince(start) * 1e6 / parses;
+
+        benchFrames(pixelFun, program.name, backendName, parseMicros, summary);
+    }
+}
+
+// Built-in effects take no time to parse.
+template<const char *source, typename Backend>
+static void benchEffect(const char *name, const char *backendName, Summary &summary) {
+    if (selected(backendName, name)) {
+        Effect<source, Backend> effect;
+        benchFrames(effect, name, backendName, 0, summary);
+    }
+}
+
+template<typename Backend>
+static void benchEffects(const char *backendName, Summary &summary) {
+    benchEffect<defaultSource, Backend>("default", backendName, summary);
+    benchEffect<xorSource, Backend>("xor", backendName, summary);
+    benchEffect<compareSource, Backend>("compare", backendName, summary);
+    benchEffect<plasmaSource, Backend>("plasma", backendName, summary);
+    benchEffect<spiralSource, Backend>("spiral", backendName, summary);
+}
+
+static void printSummary(const char *backendName, const Summary &summary) {
+    if (summary.count) {
+        printf("%-10s %-13s %9.2f ns/px geometric mean\n\n", "all", backendName,
+               exp(summary.logSum / summary.count));
+    }
+}
+
+template<typename Backend>
+static void run(const char *backendName) {
+    Summary summary = {0, 0};
+    benchBackend<Backend>(backendName, summary);
+    printSummary(backendName, summary);
+}
+
+// The effects only cover a few programs, so their mean is only comparable
+// with the lines of the same programs on the same backend.
+template<typename Backend>
+static void runEffects(const char *backendName) {
+    Summary summary = {0, 0};
+    benchEffects<Backend>(backendName, summary);
+    printSummary(backendName, summary);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            budget = atof(argv[++i]) / 1000;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    run<ScalarBackend<> >("scalar");
+    run<ScalarBackend<ApproxMath> >("scalar-approx");
+#if defined(__GNUC__)
+    run<VectorBackend<> >("vector");
+    run<VectorBackend<ApproxMath> >("vector-approx");
+#endif
+    run<FixedBackend>("fixed");
+
+    runEffects<ScalarBackend<> >("scalar-effect");
+#if defined(__GNUC__)
+    runEffects<VectorBackend<> >("vector-effect");
+#endif
+    runEffects<FixedBackend>("fixed-effect");
+
+    // Keeps the compiler from dropping the frames nobody looks at.
+    return checksum == 0xFFFFFFFF;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+// Programs the benchmark runs, chosen to cover the hot paths of the
+// evaluator: plain arithmetic, bitwise operators, comparisons, heavy trig
+// and the inverse hyperbolic functions. Centered effects assume an 8x8
+// grid like the default firmware; on larger grids they are just off center.
+struct BenchProgram {
+    const char *name;
+    const char *source;
+};
+
+// Programs that are also benchmarked as built-in effects, see Effect.h.
+constexpr char defaultSource[] = "sin(2*t-hypot(x-3.5,y-3.5))";
+constexpr char xorSource[] = "((x^y)+floor(t*4))%8/4-1";
+constexpr char compareSource[] = "(hypot(x-3.5,y-3.5)<2+sin(t)*2)*2-1";
+constexpr char plasmaSource[] = "(sin(x/2+t)+sin(y/3-t)+sin((x+y)/4+t)+sin(hypot(x-3.5,y-3.5)/2))/4";
+constexpr char spiralSource[] = "sin(atan2(y-3.5,x-3.5)*3+hypot(x-3.5,y-3.5)-t*2)";
+
+static const BenchProgram corpus[] = {
+    {"default", defaultSource},
+    {"gradient", "x/8-y/8+sin(t)"},
+    {"index", "sin(i/8+t)"},
+    {"xor", xorSource},
+    {"bits", "(x*y>>(floor(t*2)%4))&1"},
+    {"shifts", "((x<<2)|(y>>1))&(15-floor(t)%8)"},
+    {"checker", "(floor(x/2)+floor(y/2)+floor(t))%2*2-1"},
+    {"compare", compareSource},
+    {"logic", "(x>=2&&y<6||x==y)*2-1"},
+    {"rings", "fract(hypot(x-3.5,y-3.5)/3-t)*2-1"},
+    {"waves", "sin(x+t)*cos(y-t)"},
+    {"plasma", plasmaSource},
+    {"spiral", spiralSource},
+    {"tunnel", "cos(8/hypot(x-3.5,y-3.5)+t)*sin(atan2(y-3.5,x-3.5)*4)"},
+    {"trig", "tan(sin(x/4+t))*cos(y/5-t)*asin(sin(t+x*y/16))"},
+    {"hyperbolic", "atanh(sin(t+x/3)*0.9)*acosh(2+cos(y/2))/3"},
+    {"power", "(x/8)**(1+sin(t))-(y/8)**2"},
+    {"noise", "random()*2-1"},
+    // About 1 KB of source, to keep an eye on parse time.
+    {"long", "("
+             "sin(x/2+t*2)*cos(y/3-t)+fract(hypot(x-1.5,y-3.5)/1-t)+"
+             "sin(x/3+t*3)*cos(y/4-t)+fract(hypot(x-2.5,y-3.5)/2-t)+"
+             "sin(x/4+t*1)*cos(y/5-t)+fract(hypot(x-3.5,y-3.5)/3-t)+"
+             "sin(x/5+t*2)*cos(y/2-t)+fract(hypot(x-4.5,y-3.5)/4-t)+"
+             "sin(x/6+t*3)*cos(y/3-t)+fract(hypot(x-5.5,y-3.5)/5-t)+"
+             "sin(x/7+t*1)*cos(y/4-t)+fract(hypot(x-6.5,y-3.5)/6-t)+"
+             "sin(x/8+t*2)*cos(y/5-t)+fract(hypot(x-7.5,y-3.5)/7-t)+"
+             "sin(x/9+t*3)*cos(y/2-t)+fract(hypot(x-0.5,y-3.5)/8-t)+"
+             "sin(x/10+t*1)*cos(y/3-t)+fract(hypot(x-1.5,y-3.5)/9-t)+"
+             "sin(x/11+t*2)*cos(y/4-t)+fract(hypot(x-2.5,y-3.5)/10-t)+"
+             "sin(x/12+t*3)*cos(y/5-t)+fract(hypot(x-3.5,y-3.5)/11-t)+"
+             "sin(x/13+t*1)*cos(y/2-t)+fract(hypot(x-4.5,y-3.5)/12-t)+"
+             "sin(x/14+t*2)*cos(y/3-t)+fract(hypot(x-5.5,y-3.5)/13-t)+"
+             "sin(x/15+t*3)*cos(y/4-t)+fract(hypot(x-6.5,y-3.5)/14-t)+"
+             "sin(x/16+t*1)*cos(y/5-t)+fract(hypot(x-7.5,y-3.5)/15-t)+"
+             "sin(x/17+t*2)*cos(y/2-t)+fract(hypot(x-0.5,y-3.5)/16-t)+"
+             "sin(x/18+t*3)*cos(y/3-t)+fract(hypot(x-1.5,y-3.5)/17-t)+"
+             "sin(x/19+t*1)*cos(y/4-t)+fract(hypot(x-2.5,y-3.5)/18-t))/36"},
+};
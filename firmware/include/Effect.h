@@ -0,0 +1 @@
+../../lib/include/Effect.h
\ No newline at end of file
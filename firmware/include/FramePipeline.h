@@ -0,0 +1 @@
+../../lib/include/FramePipeline.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../lib/include/FrameScheduler.h
\ No newline at end of file
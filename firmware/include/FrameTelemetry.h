@@ -0,0 +1 @@
+../../lib/include/FrameTelemetry.h
\ No newline at end of file
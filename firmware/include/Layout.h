@@ -0,0 +1 @@
+../../lib/include/Layout.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../lib/include/LittleEndian.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../lib/include/Palette.h
\ No newline at end of file
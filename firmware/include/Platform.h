@@ -0,0 +1 @@
+../../lib/include/Platform.h
\ No newline at end of file
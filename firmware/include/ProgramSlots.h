@@ -0,0 +1 @@
+../../lib/include/ProgramSlots.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../lib/include/ProgramStore.h
\ No newline at end of file
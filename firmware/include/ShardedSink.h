@@ -0,0 +1 @@
+../../lib/include/ShardedSink.h
\ No newline at end of file
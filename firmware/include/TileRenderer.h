@@ -0,0 +1 @@
+../../lib/include/TileRenderer.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../lib/include/WorkerPool.h
\ No newline at end of file
@@ -1,49 +1,359 @@
 #include <Arduino.h>
 #include <Adafruit_NeoPixel.h>
 #include <NimBLEDevice.h>
-#include <tuple>
+#include <Preferences.h>
+#include <atomic>
+#include <mutex>
 #include <NimBLEHIDDevice.h>
 
+#include <Effect.h>
+#include <FramePipeline.h>
+#include <FrameScheduler.h>
+#include <FrameTelemetry.h>
+#include <Layout.h>
+#include <LittleEndian.h>
+#include <Palette.h>
 #include <PixelFun.h>
+#include <ProgramSlots.h>
+#include <ProgramStore.h>
+#include <ShardedSink.h>
 
 #ifndef DATA_PIN
 #define DATA_PIN GPIO_NUM_6
 #endif
+// Large installations split their LEDs across several strips, one on each
+// of these pins, which are sent out at the same time. The first strip has
+// the first PIXEL_COUNT / CHANNELS LEDs of the layout, the next one the
+// LEDs after that and so on, the last one any left over.
+#ifndef DATA_PINS
+#define DATA_PINS DATA_PIN
+#endif
+// The panels the strip runs through by default, WIDTH by HEIGHT LEDs each.
+// A layout written over BLE replaces this one.
 #ifndef WIDTH
 #define WIDTH 8
 #endif
 #ifndef HEIGHT
 #define HEIGHT 8
 #endif
-const int PIXEL_COUNT = WIDTH * HEIGHT;
+#ifndef PANELS_ACROSS
+#define PANELS_ACROSS 1
+#endif
+#ifndef PANELS_DOWN
+#define PANELS_DOWN 1
+#endif
+#ifndef PANEL_ROTATION
+#define PANEL_ROTATION 0
+#endif
+#ifndef LAYOUT_FLAGS
+#define LAYOUT_FLAGS (LAYOUT_SERPENTINE | LAYOUT_MIRRORED)
+#endif
+#ifndef OUTPUT_CORE
+#define OUTPUT_CORE 0
+#endif
+const int PIXEL_COUNT = WIDTH * HEIGHT * PANELS_ACROSS * PANELS_DOWN;
+const neoPixelType STRIP_TYPE = NEO_GRB + NEO_KHZ800;
+const int DATA_PIN_LIST[] = {DATA_PINS};
+const size_t CHANNELS = sizeof(DATA_PIN_LIST) / sizeof(DATA_PIN_LIST[0]);
+static_assert(CHANNELS <= PIXELFUN_MAX_CHANNELS, "Too many data pins");
+
+// Where every LED of the strip is. The BLE task sets pendingLayout and
+// layoutChanged with storeLock held, loop() rebuilds layout from it before
+// the next frame.
+Layout<PIXEL_COUNT> layout;
+GridLayout pendingLayout = {WIDTH, HEIGHT, PANELS_ACROSS, PANELS_DOWN, PANEL_ROTATION, LAYOUT_FLAGS};
+std::atomic<bool> layoutChanged(true);
+
+// The ESP32-C3 has no FPU, so it evaluates programs in fixed point.
+#ifdef PIXELFUN_FIXED_POINT
+typedef FixedBackend Backend;
+#else
+typedef ScalarBackend<ApproxMath> Backend;
+#endif
+typedef PixelFun<1024, Backend> Program;
+static_assert(PIXEL_COUNT <= Program::maxPixels(), "Too many LEDs for the backend to number them");
+// BLE takes most of the RAM, keep the program well clear of it.
+static_assert(sizeof(Program) <= 20 * 1024, "Program no longer fits its RAM budget");
+static_assert(Backend::Scalar::inRange(PIXELFUN_TIME_WRAP), "t wraps later than the backend can count");
+// t only wraps if PIXELFUN_TIME_WRAP says so, or once it reaches the most
+// seconds the backend can count: about 9 hours in fixed point, where t
+// would otherwise stop, and half a year with floats.
+const uint32_t TIME_WRAP = PIXELFUN_TIME_WRAP ? PIXELFUN_TIME_WRAP : Backend::Scalar::maxInt;
+
+// Shown until a program is installed, unless another one is resumed at
+// boot. Built in at compile time, so it renders at native speed; its source
+// is still parsed once, to be read back and stored like any other program.
+// Once stored it is resumed like any other too, and recognized by its id so
+// it keeps rendering from the built-in code after a restart.
+constexpr char DEFAULT_EFFECT[] = "sin(2*t-hypot(x-3.5,y-3.5))";
+Effect<DEFAULT_EFFECT, Backend> defaultEffect;
+bool showDefaultEffect = false;
 
-Adafruit_NeoPixel strip(PIXEL_COUNT, DATA_PIN, NEO_GRB + NEO_KHZ800);
+// Uploaded programs are compiled into the back slot by the BLE task and
+// picked up by loop() at the next frame.
+ProgramSlots<Program> programs;
+// Counts publishProgram() calls, so loop() notices a new program even if it
+// was compiled into the slot the previous one was in.
+std::atomic<uint32_t> programVersion(0);
 
-PixelFun<1024> pixelFun;
+void publishProgram()
+{
+    programs.publish();
+    programVersion++;
+}
 
 #define BLE_DEVICE_NAME "PixelFun"
 #define BLE_PIXELFUN_SERVICE_UUID "565AA538-1311-41B8-BE4D-7018A7CF18AF"
 #define BLE_PIXELFUN_PROGRAM_CHARACTERISTIC_UUID "ABC02BC7-123F-4DEC-98FF-3B7750A401DE"
+#define BLE_PIXELFUN_PROGRAM_STATUS_CHARACTERISTIC_UUID "6647E845-C992-4D20-9468-C2544B3CC25F"
+#define BLE_PIXELFUN_COMPILED_PROGRAM_CHARACTERISTIC_UUID "0F3C9A52-7D1E-4B8A-A6D4-2E5B81C07F39"
+#define BLE_PIXELFUN_PROGRAM_ID_CHARACTERISTIC_UUID "B3E1D6A4-5C27-4F0B-9A8E-61D2C4F7A035"
+#define BLE_PIXELFUN_PROGRAM_LIBRARY_CHARACTERISTIC_UUID "9D4F2B87-E6A1-4C53-8B0F-3A7E5D91C26B"
 #define BLE_PIXELFUN_BRIGHTNESS_CHARACTERISTIC_UUID "02307AFC-72B4-48DE-9FDF-EE26BA1A71C7"
 #define BLE_PIXELFUN_FRAMERATE_CHARACTERISTIC_UUID "C8B74D1F-B691-4825-A60C-7D78D77A322E"
+#define BLE_PIXELFUN_TELEMETRY_CHARACTERISTIC_UUID "639E6788-6288-40BC-9956-8558A5E4C6E5"
 #define BLE_PIXELFUN_COLOR1_CHARACTERISTIC_UUID "EF598BF8-6CEC-4054-8926-990C5D46B1DA"
 #define BLE_PIXELFUN_COLOR2_CHARACTERISTIC_UUID "4B95E86E-5207-4230-B838-ED361BDFC859"
+#define BLE_PIXELFUN_GRADIENT_CHARACTERISTIC_UUID "7E21C3A9-4B6D-4F8E-9C15-D83A6B2F0E47"
+#define BLE_PIXELFUN_LAYOUT_CHARACTERISTIC_UUID "2A6C8E14-93B7-4D05-B1F2-7C4E9A3D5B68"
 
 NimBLEServer *pServer;
 NimBLEService *pService;
 NimBLECharacteristic *pProgramCharacteristic;
+NimBLECharacteristic *pProgramStatusCharacteristic;
+NimBLECharacteristic *pCompiledProgramCharacteristic;
+NimBLECharacteristic *pProgramIdCharacteristic;
+NimBLECharacteristic *pProgramLibraryCharacteristic;
 NimBLECharacteristic *pBrightnessCharacteristic;
 NimBLECharacteristic *pFrameRateCharacteristic;
+NimBLECharacteristic *pTelemetryCharacteristic;
 NimBLECharacteristic *pColor1Characteristic;
 NimBLECharacteristic *pColor2Characteristic;
+NimBLECharacteristic *pGradientCharacteristic;
+NimBLECharacteristic *pLayoutCharacteristic;
 NimBLEAdvertising *pAdvertising;
 
-char program[1024] = "sin(2*t-hypot(x-3.5,y-3.5))";
+char program[1024];
 uint8_t brightness = 25;
 uint8_t color1[3] = {251, 72, 196};
 uint8_t color2[3] = {63, 255, 33};
+// A gradient written over BLE replaces color1 and color2 until one of them
+// is written again. There is none while gradientStops is 0. The BLE task
+// changes the colors, the gradient and the brightness with storeLock held,
+// loop() rebuilds the palette from them with it held too.
+PaletteStop gradient[PIXELFUN_PALETTE_STOPS];
+size_t gradientStops = 0;
 uint8_t frameRate = 60;
 
+// Keeps the program store in NVS.
+class PreferencesStorage : public Storage
+{
+public:
+    void begin() { preferences.begin("pixelfun", false); }
+
+    size_t read(const char *key, uint8_t *data, size_t capacity) override
+    {
+        if (!preferences.isKey(key) || preferences.getBytesLength(key) > capacity)
+        {
+            return 0;
+        }
+        return preferences.getBytes(key, data, capacity);
+    }
+
+    bool write(const char *key, const uint8_t *data, size_t size) override
+    {
+        return preferences.putBytes(key, data, size) == size;
+    }
+
+private:
+    Preferences preferences;
+};
+
+// Uploaded programs and settings are only written to flash once they have
+// stayed the same for STORE_DELAY ms, so typing a program or dragging a
+// slider doesn't wear the flash out. The BLE task switches programs and
+// records changes, loop() writes them; storeLock guards the store and the
+// pending changes.
+const uint32_t STORE_DELAY = 3000;
+PreferencesStorage storage;
+ProgramStore store(storage);
+std::mutex storeLock;
+uint8_t pendingProgram[PIXELFUN_STORE_PROGRAM_BYTES];
+size_t pendingProgramSize = 0;
+bool pendingSettings = false;
+uint32_t lastChange = 0;
+
+// loop() colors pixels through palette and rebuilds it before the next frame
+// whenever this is set, which the colors and the brightness do.
+Palette palette;
+std::atomic<bool> paletteChanged(true);
+
+// Called after color1, color2 or the gradient changed, with storeLock held.
+// Gradients are only kept until the two colors are set again.
+void colorsChanged(bool useGradient)
+{
+    if (!useGradient)
+    {
+        gradientStops = 0;
+    }
+    paletteChanged.store(true);
+}
+
+ProgramSettings currentSettings()
+{
+    ProgramSettings settings;
+    memcpy(settings.color1, color1, 3);
+    memcpy(settings.color2, color2, 3);
+    settings.brightness = brightness;
+    settings.frameRate = frameRate;
+    return settings;
+}
+
+void applySettings(const ProgramSettings &settings)
+{
+    memcpy(color1, settings.color1, 3);
+    memcpy(color2, settings.color2, 3);
+    brightness = settings.brightness;
+    frameRate = settings.frameRate ? settings.frameRate : 1;
+    colorsChanged(false);
+}
+
+void publishSettings()
+{
+    pBrightnessCharacteristic->setValue(&brightness, 1);
+    pFrameRateCharacteristic->setValue(&frameRate, 1);
+    pColor1Characteristic->setValue(color1, 3);
+    pColor2Characteristic->setValue(color2, 3);
+}
+
+// Makes the id of the active program and the ids of all stored programs
+// readable, as little endian 32-bit integers.
+void publishLibrary()
+{
+    uint32_t ids[PIXELFUN_STORE_PROGRAMS];
+    uint8_t encoded[4 * PIXELFUN_STORE_PROGRAMS];
+    size_t count = store.list(ids);
+    for (size_t n = 0; n < count; n++)
+    {
+        writeLE32(encoded + 4 * n, ids[n]);
+    }
+    pProgramLibraryCharacteristic->setValue(encoded, 4 * count);
+
+    uint8_t active[4];
+    writeLE32(active, store.active());
+    pProgramIdCharacteristic->setValue(active, sizeof(active));
+}
+
+void settingsChanged()
+{
+    std::lock_guard<std::mutex> lock(storeLock);
+    pendingSettings = true;
+    lastChange = millis();
+}
+
+// Writes pending changes to the store. Called with storeLock held.
+void storePendingChanges()
+{
+    if (pendingProgramSize)
+    {
+        uint32_t id = store.add(pendingProgram, pendingProgramSize, currentSettings());
+        Serial.printf("stored program %08x\n", (unsigned)id);
+    }
+    else if (pendingSettings)
+    {
+        store.update(store.active(), currentSettings());
+    }
+    if (pendingProgramSize || pendingSettings)
+    {
+        pendingProgramSize = 0;
+        pendingSettings = false;
+        publishLibrary();
+    }
+}
+
+// Tells the client whether the last program compiled: "OK", or the byte
+// offset the parser stopped at and why, as in "12: Expected ')'".
+void reportProgramStatus(Program &compiled, bool notify)
+{
+    char status[64];
+    if (compiled.error())
+    {
+        snprintf(status, sizeof(status), "%u: %s", (unsigned)compiled.errorOffset(), compiled.error());
+    }
+    else
+    {
+        strcpy(status, "OK");
+    }
+    Serial.println(status);
+    pProgramStatusCharacteristic->setValue((uint8_t *)status, strlen(status));
+    if (notify)
+    {
+        pProgramStatusCharacteristic->notify();
+    }
+}
+
+// Returns the slot to install the next program into, once the renderer is
+// done with it.
+Program &nextProgram()
+{
+    Program *next;
+    while ((next = programs.back()) == nullptr)
+    {
+        vTaskDelay(1);
+    }
+    return *next;
+}
+
+// Makes the compiled form of a newly installed program readable, so clients
+// can keep it and later upload it without the device parsing anything, and
+// queues it to be stored. Programs that don't fit into a BLE attribute
+// leave it empty and aren't stored.
+void exportProgram(Program &compiled)
+{
+    std::lock_guard<std::mutex> lock(storeLock);
+    pendingProgramSize = compiled.encode(pendingProgram, sizeof(pendingProgram));
+    lastChange = millis();
+    pCompiledProgramCharacteristic->setValue(pendingProgram, pendingProgramSize);
+}
+
+// The id the default effect is stored under, 0 if it can't be stored.
+// Compiles it into the back slot, so only call this before rendering starts.
+uint32_t defaultEffectId()
+{
+    uint8_t encoded[PIXELFUN_STORE_PROGRAM_BYTES];
+    Program &scratch = *programs.back();
+    size_t size = scratch.parse(DEFAULT_EFFECT) ? scratch.encode(encoded, sizeof(encoded)) : 0;
+    return size ? ProgramStore::programId(encoded) : 0;
+}
+
+// Installs the stored program id along with its settings.
+void switchProgram(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(storeLock);
+    storePendingChanges();
+    if (id == store.active())
+    {
+        return;
+    }
+    Program &next = nextProgram();
+    ProgramSettings settings;
+    if (store.load(id, next, settings))
+    {
+        Serial.printf("switched to program %08x\n", (unsigned)id);
+        applySettings(settings);
+        publishSettings();
+        publishProgram();
+        uint8_t encoded[PIXELFUN_STORE_PROGRAM_BYTES];
+        pCompiledProgramCharacteristic->setValue(encoded, next.encode(encoded, sizeof(encoded)));
+        publishLibrary();
+        reportProgramStatus(next, true);
+    }
+    else
+    {
+        Serial.printf("no program %08x\n", (unsigned)id);
+    }
+}
+
 class CharacteristicCallbacks : public NimBLECharacteristicCallbacks
 {
     void onWrite(NimBLECharacteristic *characteristic) override
@@ -55,22 +365,63 @@ class CharacteristicCallbacks : public NimBLECharacteristicCallbacks
             strncpy(program, (char *)characteristic->getValue().data(), sizeof(program) - 1);
             program[sizeof(program) - 1] = '\0';
             Serial.println(program);
-            if (pixelFun.parse(program))
+            Program &next = nextProgram();
+            if (next.parse(program))
             {
-                Serial.println("parse succeeded");
-                pixelFun.printAST();
+                Serial.printf("parse succeeded, %u nodes, %u saved\n", (unsigned)next.programNodes(),
+                              (unsigned)(next.parsedNodes() - next.programNodes()));
+                next.printAST();
+                publishProgram();
+                exportProgram(next);
             }
             else
             {
                 Serial.println("parse failed");
             }
+            reportProgramStatus(next, true);
+        }
+        else if (characteristic == pCompiledProgramCharacteristic)
+        {
+            Serial.println("Compiled Program");
+            NimBLEAttValue value = characteristic->getValue();
+            Program &next = nextProgram();
+            if (next.decode(value.data(), value.length()))
+            {
+                Serial.println("decode succeeded");
+                next.printAST();
+                publishProgram();
+                exportProgram(next);
+            }
+            else
+            {
+                Serial.println("decode failed");
+            }
+            reportProgramStatus(next, true);
+        }
+        else if (characteristic == pProgramIdCharacteristic)
+        {
+            Serial.println("Program ID");
+            NimBLEAttValue value = characteristic->getValue();
+            if (value.length() == 4)
+            {
+                switchProgram(readLE32(value.data()));
+            }
+            else
+            {
+                Serial.println("Invalid length");
+            }
         }
         else if (characteristic == pBrightnessCharacteristic)
         {
             Serial.println("Brightness");
-            brightness = characteristic->getValue().data()[0];
-            Serial.println(brightness);
-            strip.setBrightness(brightness);
+            uint8_t level = characteristic->getValue().data()[0];
+            {
+                std::lock_guard<std::mutex> lock(storeLock);
+                brightness = level;
+                paletteChanged.store(true);
+            }
+            Serial.println(level);
+            settingsChanged();
         }
         else if (characteristic == pFrameRateCharacteristic)
         {
@@ -81,14 +432,22 @@ class CharacteristicCallbacks : public NimBLECharacteristicCallbacks
                 frameRate = 1;
             }
             Serial.println(frameRate);
+            settingsChanged();
         }
         else if (characteristic == pColor1Characteristic)
         {
             Serial.println("Color 1");
-            if (characteristic->getValue().length() == 3)
+            NimBLEAttValue value = characteristic->getValue();
+            if (value.length() == 3)
             {
-                memcpy(color1, characteristic->getValue().data(), 3);
-                Serial.printf("%d %d %d\n", color1[0], color1[1], color1[2]);
+                const uint8_t *color = value.data();
+                {
+                    std::lock_guard<std::mutex> lock(storeLock);
+                    memcpy(color1, color, 3);
+                    colorsChanged(false);
+                }
+                Serial.printf("%d %d %d\n", color[0], color[1], color[2]);
+                settingsChanged();
             }
             else
             {
@@ -98,16 +457,75 @@ class CharacteristicCallbacks : public NimBLECharacteristicCallbacks
         else if (characteristic == pColor2Characteristic)
         {
             Serial.println("Color 2");
-            if (characteristic->getValue().length() == 3)
+            NimBLEAttValue value = characteristic->getValue();
+            if (value.length() == 3)
             {
-                memcpy(color2, characteristic->getValue().data(), 3);
-                Serial.printf("%d %d %d\n", color2[0], color2[1], color2[2]);
+                const uint8_t *color = value.data();
+                {
+                    std::lock_guard<std::mutex> lock(storeLock);
+                    memcpy(color2, color, 3);
+                    colorsChanged(false);
+                }
+                Serial.printf("%d %d %d\n", color[0], color[1], color[2]);
+                settingsChanged();
             }
             else
             {
                 Serial.println("Invalid length");
             }
         }
+        else if (characteristic == pGradientCharacteristic)
+        {
+            // Up to PIXELFUN_PALETTE_STOPS stops of position, r, g and b,
+            // sorted by position.
+            Serial.println("Gradient");
+            NimBLEAttValue value = characteristic->getValue();
+            PaletteStop stops[PIXELFUN_PALETTE_STOPS];
+            size_t count = value.length() / sizeof(PaletteStop);
+            if (value.length() % sizeof(PaletteStop) != 0 || count > PIXELFUN_PALETTE_STOPS)
+            {
+                count = 0;
+            }
+            memcpy(stops, value.data(), count * sizeof(PaletteStop));
+            if (Palette::isGradient(stops, count))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(storeLock);
+                    memcpy(gradient, stops, count * sizeof(PaletteStop));
+                    gradientStops = count;
+                    colorsChanged(true);
+                }
+                Serial.printf("%u stops\n", (unsigned)count);
+            }
+            else
+            {
+                Serial.println("Invalid gradient");
+            }
+        }
+        else if (characteristic == pLayoutCharacteristic)
+        {
+            // A GridLayout, kept in NVS across restarts.
+            Serial.println("Layout");
+            GridLayout grid = {};
+            NimBLEAttValue value = characteristic->getValue();
+            if (value.length() == sizeof(grid))
+            {
+                memcpy(&grid, value.data(), sizeof(grid));
+            }
+            if (Layout<PIXEL_COUNT>::fits(grid))
+            {
+                std::lock_guard<std::mutex> lock(storeLock);
+                pendingLayout = grid;
+                layoutChanged.store(true);
+                storage.write("layout", (const uint8_t *)&grid, sizeof(grid));
+                Serial.printf("%u x %u panels of %u x %u\n", grid.panelsAcross, grid.panelsDown, grid.panelWidth,
+                              grid.panelHeight);
+            }
+            else
+            {
+                Serial.println("Invalid layout");
+            }
+        }
         else
         {
             Serial.println("Unknown");
@@ -117,10 +535,92 @@ class CharacteristicCallbacks : public NimBLECharacteristicCallbacks
 
 CharacteristicCallbacks characteristicCallbacks;
 
+// Owns one strip. Only the output task and the threads of output touch it.
+// Frames arrive in the strip's wire format with the brightness applied, so
+// they go into its buffer unchanged. Never call setBrightness() on it.
+class StripSink : public FrameSink
+{
+public:
+    void begin(int pin, size_t count)
+    {
+        strip.updateType(STRIP_TYPE);
+        strip.updateLength(count);
+        strip.setPin(pin);
+        strip.begin();
+        strip.show();
+    }
+
+    void write(const uint8_t *pixels, size_t count) override
+    {
+        memcpy(strip.getPixels(), pixels, 3 * count);
+        strip.show();
+    }
+
+private:
+    Adafruit_NeoPixel strip;
+};
+
+StripSink strips[CHANNELS];
+ShardedSink output;
+FramePipeline<PIXEL_COUNT> pipeline;
+FrameScheduler scheduler(frameRate);
+FrameTelemetry telemetry;
+std::atomic<uint32_t> showTime(0);
+TaskHandle_t renderTask;
+TaskHandle_t outputTask;
+
+// Sends rendered frames to the strips while loop() renders the next one.
+void outputLoop(void *)
+{
+    for (;;)
+    {
+        int64_t start = esp_timer_get_time();
+        if (pipeline.output(output))
+        {
+            showTime.store(esp_timer_get_time() - start, std::memory_order_relaxed);
+            xTaskNotifyGive(renderTask);
+        }
+        else
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+}
+
 void setup()
 {
     Serial.begin(115200);
 
+    // Resume the program that was active before the last reset, with its
+    // settings. Its source isn't stored, so the program characteristic
+    // starts out empty then, unless it is the default effect. Without one,
+    // the default effect is shown.
+    storage.begin();
+    store.begin();
+    GridLayout storedLayout;
+    if (storage.read("layout", (uint8_t *)&storedLayout, sizeof(storedLayout)) == sizeof(storedLayout) &&
+        Layout<PIXEL_COUNT>::fits(storedLayout))
+    {
+        pendingLayout = storedLayout;
+    }
+    ProgramSettings settings;
+    bool resumed = store.resume(programs.current(), settings);
+    if (resumed)
+    {
+        Serial.printf("resumed program %08x\n", (unsigned)store.active());
+        applySettings(settings);
+        if (store.active() == defaultEffectId())
+        {
+            strcpy(program, DEFAULT_EFFECT);
+            showDefaultEffect = true;
+        }
+    }
+    else
+    {
+        strcpy(program, DEFAULT_EFFECT);
+        showDefaultEffect = true;
+    }
+
     NimBLEDevice::init(BLE_DEVICE_NAME);
     NimBLEDevice::setDeviceName(BLE_DEVICE_NAME);
     NimBLEDevice::setPower(ESP_PWR_LVL_P9);
@@ -136,6 +636,24 @@ void setup()
     pProgramCharacteristic->setCallbacks(&characteristicCallbacks);
     pProgramCharacteristic->setValue((uint8_t *)program, strlen(program));
 
+    pProgramStatusCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_PROGRAM_STATUS_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY);
+
+    pCompiledProgramCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_COMPILED_PROGRAM_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
+    pCompiledProgramCharacteristic->setCallbacks(&characteristicCallbacks);
+
+    pProgramIdCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_PROGRAM_ID_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
+    pProgramIdCharacteristic->setCallbacks(&characteristicCallbacks);
+
+    pProgramLibraryCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_PROGRAM_LIBRARY_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ);
+
     pBrightnessCharacteristic = pService->createCharacteristic(
         BLE_PIXELFUN_BRIGHTNESS_CHARACTERISTIC_UUID,
         NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
@@ -148,6 +666,10 @@ void setup()
     pFrameRateCharacteristic->setCallbacks(&characteristicCallbacks);
     pFrameRateCharacteristic->setValue(&frameRate, 1);
 
+    pTelemetryCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_TELEMETRY_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY);
+
     pColor1Characteristic = pService->createCharacteristic(
         BLE_PIXELFUN_COLOR1_CHARACTERISTIC_UUID,
         NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
@@ -160,6 +682,17 @@ void setup()
     pColor2Characteristic->setCallbacks(&characteristicCallbacks);
     pColor2Characteristic->setValue(color2, 3);
 
+    pGradientCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_GRADIENT_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
+    pGradientCharacteristic->setCallbacks(&characteristicCallbacks);
+
+    pLayoutCharacteristic = pService->createCharacteristic(
+        BLE_PIXELFUN_LAYOUT_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE_NR);
+    pLayoutCharacteristic->setCallbacks(&characteristicCallbacks);
+    pLayoutCharacteristic->setValue((uint8_t *)&pendingLayout, sizeof(pendingLayout));
+
     pService->start();
 
     pAdvertising = NimBLEDevice::getAdvertising();
@@ -178,43 +711,242 @@ void setup()
         Serial.println("Failed to start advertising");
     }
 
-    if (pixelFun.parse(program))
+    if (resumed)
     {
-        Serial.println("parse succeeded");
+        uint8_t encoded[PIXELFUN_STORE_PROGRAM_BYTES];
+        pCompiledProgramCharacteristic->setValue(encoded, programs.current().encode(encoded, sizeof(encoded)));
+    }
+    else if (programs.current().parse(program))
+    {
+        Serial.printf("parse succeeded, %u nodes, %u saved\n", (unsigned)programs.current().programNodes(),
+                      (unsigned)(programs.current().parsedNodes() - programs.current().programNodes()));
+        exportProgram(programs.current());
     }
     else
     {
         Serial.println("parse failed");
     }
+    reportProgramStatus(programs.current(), false);
+    publishLibrary();
 
-    pixelFun.printAST();
+    programs.current().printAST();
 
-    strip.begin();
-    strip.setBrightness(25);
-    strip.show();
+    for (size_t channel = 0; channel < CHANNELS; channel++)
+    {
+        size_t count = PIXEL_COUNT / CHANNELS;
+        if (channel == CHANNELS - 1)
+        {
+            count = PIXEL_COUNT - count * (CHANNELS - 1);
+        }
+        strips[channel].begin(DATA_PIN_LIST[channel], count);
+        output.addChannel(strips[channel], count);
+    }
+
+    renderTask = xTaskGetCurrentTaskHandle();
+    xTaskCreatePinnedToCore(outputLoop, "output", 4096, nullptr, 1, &outputTask, OUTPUT_CORE);
+
+    scheduler.setTimeWrap(TIME_WRAP);
+    scheduler.start(esp_timer_get_time());
 }
 
-float current_time = 0.0f;
+uint8_t frame[PIXEL_COUNT];
+// The last frame sent to the strips, and the program version it showed.
+uint8_t lastFrame[FramePipeline<PIXEL_COUNT>::frameSize];
+uint32_t lastVersion = UINT32_MAX;
+uint64_t lastFrameStart = 0;
+uint32_t lastMissed = 0;
+uint32_t lastTelemetryUpdate = 0;
+uint32_t lastTelemetryLog = 0;
+
+// Sleeps through most of the wait and spins for the rest, FreeRTOS ticks
+// are too coarse to hit frame deadlines.
+void waitForNextFrame()
+{
+    uint64_t wait;
+    while ((wait = scheduler.timeUntilNextFrame(esp_timer_get_time())) > 0)
+    {
+        if (wait > 2000)
+        {
+            vTaskDelay(pdMS_TO_TICKS(wait / 1000 - 1));
+        }
+        else
+        {
+            delayMicroseconds(wait);
+        }
+    }
+}
+
+// Prints every frame in the telemetry buffer, oldest first.
+void dumpTelemetry()
+{
+    Serial.println("eval_us,show_us,idle_us,frame_us,missed");
+    for (size_t age = telemetry.size(); age-- > 0;)
+    {
+        const FrameSample &sample = telemetry.sample(age);
+        Serial.printf("%u,%u,%u,%u,%u\n", (unsigned)sample.eval, (unsigned)sample.show, (unsigned)sample.idle,
+                      (unsigned)sample.frame, (unsigned)sample.missed);
+    }
+}
+
+// Publishes a summary of the telemetry buffer once a second and logs it
+// every 10 seconds. Sending 't' over serial dumps the whole buffer.
+void reportTelemetry()
+{
+    while (Serial.available() > 0)
+    {
+        if (Serial.read() == 't')
+        {
+            dumpTelemetry();
+        }
+    }
+
+    uint32_t now = millis();
+    if (now - lastTelemetryUpdate < 1000)
+    {
+        return;
+    }
+    lastTelemetryUpdate = now;
+
+    FrameReport report = telemetry.report();
+    uint8_t encoded[FrameReport::encodedSize];
+    pTelemetryCharacteristic->setValue(encoded, report.encode(encoded));
+    pTelemetryCharacteristic->notify();
+
+    if (now - lastTelemetryLog >= 10000)
+    {
+        lastTelemetryLog = now;
+        Serial.printf("%.1f fps, frame min/avg/p99 %u/%u/%u us, eval %u us, show %u us, idle %u us, %u missed\n",
+                      scheduler.stats().fps, (unsigned)report.frameMin, (unsigned)report.frameAverage,
+                      (unsigned)report.frameP99, (unsigned)report.evalAverage, (unsigned)report.showAverage,
+                      (unsigned)report.idleAverage, (unsigned)report.missed);
+    }
+}
 
 void loop()
 {
-    for (int y = 0; y < HEIGHT; y++)
+    uint64_t idleStart = esp_timer_get_time();
+    uint8_t *pixels;
+    while ((pixels = pipeline.beginRender()) == nullptr)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    scheduler.setFrameRate(frameRate);
+    waitForNextFrame();
+    uint64_t frameStart = esp_timer_get_time();
+    float current_time = scheduler.beginFrame(frameStart);
+
+    // Read before beginFrame(), so a program published in between is at
+    // worst rendered twice, never missed.
+    uint32_t version = programVersion.load();
+    bool changed = version != lastVersion;
+
+    // storeLock guards pendingLayout and the colors. Rather than wait for it,
+    // try again at the next frame.
+    if (layoutChanged.exchange(false))
     {
-        for (int x = 0; x < WIDTH; x++)
+        if (storeLock.try_lock())
         {
-            int idx = y * WIDTH + x;
-            int led_idx = idx;
-            if (y % 2 == 0)
+            layout.setGrid(pendingLayout);
+            storeLock.unlock();
+            changed = true;
+        }
+        else
+        {
+            layoutChanged.store(true);
+        }
+    }
+    if (paletteChanged.exchange(false))
+    {
+        if (storeLock.try_lock())
+        {
+            palette.setOutput(WireFormat::neoPixel(STRIP_TYPE, brightness));
+            if (gradientStops)
+            {
+                palette.setGradient(gradient, gradientStops);
+            }
+            else
             {
-                led_idx = y * WIDTH + (WIDTH - 1 - x);
+                palette.setColors(color1, color2);
             }
-            float value = pixelFun.eval(current_time, float(idx), float(x), float(y));
-            uint8_t r, g, b;
-            std::tie(r, g, b) = pixelFun.interpolateColors(color1, color2, value);
-            strip.setPixelColor(led_idx, Adafruit_NeoPixel::Color(r, g, b));
+            storeLock.unlock();
+            changed = true;
+        }
+        else
+        {
+            paletteChanged.store(true);
+        }
+    }
+
+    // Static programs are only rendered again when something changed.
+    // Uniform ones are evaluated once per frame by evalPoints() itself.
+    Program &pixelFun = programs.beginFrame();
+    bool builtin = showDefaultEffect && version == 0;
+    RenderMode mode = builtin ? defaultEffect.renderMode() : pixelFun.renderMode();
+    if (version != lastVersion)
+    {
+        static const char *const modes[] = {"static", "uniform", "full"};
+        Serial.printf("render mode %s\n", modes[mode]);
+    }
+    bool render = changed || mode != RENDER_STATIC;
+    if (render)
+    {
+        // LEDs left out of the layout stay dark.
+        if (layout.size() < PIXEL_COUNT)
+        {
+            memset(pixels, 0, FramePipeline<PIXEL_COUNT>::frameSize);
+        }
+        if (builtin)
+        {
+            defaultEffect.evalPoints(current_time, layout.begin(), layout.size(), frame);
+        }
+        else
+        {
+            pixelFun.evalPoints(current_time, layout.begin(), layout.size(), frame);
+        }
+        const LayoutPoint *points = layout.begin();
+        for (size_t n = 0; n < layout.size(); n++)
+        {
+            memcpy(pixels + 3 * points[n].led, palette[frame[n]], 3);
+        }
+    }
+    programs.endFrame();
+    lastVersion = version;
+    uint64_t evalEnd = esp_timer_get_time();
+
+    // Frames the strips already show aren't sent again, the buffer is
+    // simply rendered into once more.
+    if (render && memcmp(pixels, lastFrame, sizeof(lastFrame)) != 0)
+    {
+        memcpy(lastFrame, pixels, sizeof(lastFrame));
+        pipeline.endRender();
+        xTaskNotifyGive(outputTask);
+    }
+
+    const FrameStats &stats = scheduler.stats();
+    if (lastFrameStart != 0)
+    {
+        FrameSample sample;
+        sample.eval = evalEnd - frameStart;
+        sample.show = showTime.load(std::memory_order_relaxed);
+        sample.idle = frameStart - idleStart;
+        sample.frame = frameStart - lastFrameStart;
+        sample.missed = stats.late + stats.skipped - lastMissed;
+        telemetry.record(sample);
+    }
+    lastFrameStart = frameStart;
+    lastMissed = stats.late + stats.skipped;
+
+    reportTelemetry();
+
+    // Never wait for the BLE task, the changes can just as well be stored
+    // after the next frame.
+    if (storeLock.try_lock())
+    {
+        if (millis() - lastChange >= STORE_DELAY)
+        {
+            storePendingChanges();
         }
+        storeLock.unlock();
     }
-    strip.show();
-    current_time += 1.0f / float(frameRate);
-    delayMicroseconds(1000000 / frameRate);
 }
@@ -0,0 +1,820 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "PixelFun.h"
+
+#if __cplusplus < 201703L
+#error "Effect.h needs C++17, the rest of the library builds as C++11"
+#endif
+
+// Built-in effects: programs written in the PixelFun language as part of
+// the C++ source, parsed by the compiler instead of at runtime. Each one
+// becomes a function the compiler can inline, fold and vectorize like any
+// other code, so it needs no node pool, no compiled code and no parse.
+//
+//     constexpr char ripple[] = "sin(2*t-hypot(x-3.5,y-3.5))";
+//     Effect<ripple, VectorBackend<> > effect;
+//     effect.evalFrame(t, 8, 8, frame);
+//
+// A source that doesn't parse fails the build, see EffectParseError.
+
+// A node of a built-in effect. Children precede their parents, like in
+// the node array of a PixelFun.
+struct EffectNode {
+    ExprType type;
+    // The BinOpType, Var or FuncType.
+    uint8_t op;
+    uint8_t arity;
+    // Dependency flags, like PixelFun::tag() computes them.
+    uint8_t deps;
+    uint16_t args[2];
+    float number;
+};
+
+// What parseEffect() makes of a source: its nodes, or why it doesn't parse.
+template<size_t capacity>
+struct EffectTree {
+    EffectNode nodes[capacity];
+    size_t count;
+    size_t root;
+    const char *error;
+    size_t errorOffset;
+
+    constexpr uint16_t add(const EffectNode &node) {
+        nodes[count] = node;
+        return (uint16_t) count++;
+    }
+
+    constexpr EffectTree fail(const char *message, size_t offset) {
+        error = message;
+        errorOffset = offset;
+        return *this;
+    }
+};
+
+struct EffectToken {
+    TokenType type;
+    // The BinOpType, Var or FuncType.
+    uint8_t op;
+    uint8_t arity;
+    float number;
+    size_t offset;
+};
+
+// Lexer at compile time. Reads the same tokens, except that numbers are
+// only decimal, where Lexer also takes whatever else strtof() does.
+class EffectLexer {
+public:
+    constexpr explicit EffectLexer(const char *source) : source(source), input(0) {}
+
+    constexpr EffectToken next(bool value) {
+        while (source[input] == ' ' || (source[input] >= '\t' && source[input] <= '\r')) {
+            input++;
+        }
+
+        EffectToken token = {TOKEN_INVALID, BINOP_ADD, 0, 0, input};
+        char c = source[input];
+        if (c == '\0') {
+            token.type = TOKEN_END;
+            return token;
+        }
+        if (digit(c) || c == '.' || (value && (c == '+' || c == '-'))) {
+            if (number(token)) {
+                return token;
+            }
+        }
+        if (alpha(c)) {
+            size_t start = input;
+            while (alpha(source[input]) || digit(source[input]) || source[input] == '_') {
+                input++;
+            }
+            keyword(source + start, input - start, token);
+            return token;
+        }
+
+        input++;
+        switch (c) {
+            case '(':
+                token.type = TOKEN_OPEN;
+                break;
+            case ')':
+                token.type = TOKEN_CLOSE;
+                break;
+            case ',':
+                token.type = TOKEN_COMMA;
+                break;
+            case '+':
+                binOp(token, BINOP_ADD);
+                break;
+            case '-':
+                binOp(token, BINOP_SUB);
+                break;
+            case '*':
+                binOp(token, follows('*') ? BINOP_POW : BINOP_MUL);
+                break;
+            case '/':
+                binOp(token, BINOP_DIV);
+                break;
+            case '%':
+                binOp(token, BINOP_MOD);
+                break;
+            case '<':
+                binOp(token, follows('<') ? BINOP_LSHIFT : follows('=') ? BINOP_LTE : BINOP_LT);
+                break;
+            case '>':
+                binOp(token, follows('>') ? BINOP_RSHIFT : follows('=') ? BINOP_GTE : BINOP_GT);
+                break;
+            case '=':
+                if (follows('=')) {
+                    binOp(token, BINOP_EQ);
+                }
+                break;
+            case '!':
+                if (follows('=')) {
+                    binOp(token, BINOP_NEQ);
+                }
+                break;
+            case '|':
+                binOp(token, follows('|') ? BINOP_OR : BINOP_BIT_OR);
+                break;
+            case '&':
+                binOp(token, follows('&') ? BINOP_AND : BINOP_BIT_AND);
+                break;
+            case '^':
+                binOp(token, BINOP_BIT_XOR);
+                break;
+        }
+        return token;
+    }
+
+    static constexpr bool digit(char c) { return c >= '0' && c <= '9'; }
+
+    static constexpr bool alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+private:
+    struct Name {
+        const char *name;
+        TokenType type;
+        uint8_t op;
+        uint8_t arity;
+    };
+
+    static constexpr Name names[] = {
+        {"t", TOKEN_VAR, VAR_T, 0},          {"i", TOKEN_VAR, VAR_I, 0},
+        {"x", TOKEN_VAR, VAR_X, 0},          {"y", TOKEN_VAR, VAR_Y, 0},
+        {"pi", TOKEN_VAR, VAR_PI, 0},        {"tau", TOKEN_VAR, VAR_TAU, 0},
+        {"rand", TOKEN_FUNC, FUNC_RAND, 0},  {"random", TOKEN_FUNC, FUNC_RANDOM, 0},
+        {"sin", TOKEN_FUNC, FUNC_SIN, 1},    {"cos", TOKEN_FUNC, FUNC_COS, 1},
+        {"tan", TOKEN_FUNC, FUNC_TAN, 1},    {"asin", TOKEN_FUNC, FUNC_ASIN, 1},
+        {"acos", TOKEN_FUNC, FUNC_ACOS, 1},  {"atan", TOKEN_FUNC, FUNC_ATAN, 1},
+        {"atan2", TOKEN_FUNC, FUNC_ATAN2, 2}, {"asinh", TOKEN_FUNC, FUNC_ASINH, 1},
+        {"acosh", TOKEN_FUNC, FUNC_ACOSH, 1}, {"atanh", TOKEN_FUNC, FUNC_ATANH, 1},
+        {"floor", TOKEN_FUNC, FUNC_FLOOR, 1}, {"ceil", TOKEN_FUNC, FUNC_CEIL, 1},
+        {"round", TOKEN_FUNC, FUNC_ROUND, 1}, {"fract", TOKEN_FUNC, FUNC_FRACT, 1},
+        {"trunc", TOKEN_FUNC, FUNC_TRUNC, 1}, {"hypot", TOKEN_FUNC, FUNC_HYPOT, 2},
+    };
+
+    const char *source;
+    size_t input;
+
+    constexpr bool follows(char c) {
+        if (source[input] != c) {
+            return false;
+        }
+        input++;
+        return true;
+    }
+
+    static constexpr void binOp(EffectToken &token, BinOpType op) {
+        token.type = TOKEN_BINOP;
+        token.op = op;
+    }
+
+    // Unknown names leave the token invalid.
+    static constexpr void keyword(const char *name, size_t length, EffectToken &token) {
+        for (const Name &candidate : names) {
+            size_t n = 0;
+            while (n < length && candidate.name[n] == name[n]) {
+                n++;
+            }
+            if (n == length && candidate.name[n] == '\0') {
+                token.type = candidate.type;
+                token.op = candidate.op;
+                token.arity = candidate.arity;
+                return;
+            }
+        }
+    }
+
+    // A decimal number with an optional sign, fraction and exponent. Up to
+    // 19 significant digits are kept, which gives the same float as
+    // strtof() for any literal an effect would reasonably contain.
+    constexpr bool number(EffectToken &token) {
+        size_t at = input;
+        bool negative = source[at] == '-';
+        if (source[at] == '+' || source[at] == '-') {
+            at++;
+        }
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        bool any = false;
+        for (; digit(source[at]); at++, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (source[at] - '0');
+                digits += mantissa != 0;
+            } else {
+                exponent++;
+            }
+        }
+        if (source[at] == '.') {
+            for (at++; digit(source[at]); at++, any = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (source[at] - '0');
+                    digits += mantissa != 0;
+                    exponent--;
+                }
+            }
+        }
+        if (!any) {
+            return false;
+        }
+        if (source[at] == 'e' || source[at] == 'E') {
+            size_t start = at++;
+            bool negativeExponent = source[at] == '-';
+            if (source[at] == '+' || source[at] == '-') {
+                at++;
+            }
+            if (digit(source[at])) {
+                int value = 0;
+                for (; digit(source[at]); at++) {
+                    value = value < 1000 ? value * 10 + (source[at] - '0') : value;
+                }
+                exponent += negativeExponent ? -value : value;
+            } else {
+                at = start;
+            }
+        }
+
+        // Powers of ten up to 1e22 are exact, so the usual literals take a
+        // single rounding.
+        double scale = 1;
+        for (int e = exponent < 0 ? -exponent : exponent; e > 0; e--) {
+            scale *= 10;
+        }
+        double result = exponent < 0 ? mantissa / scale : mantissa * scale;
+        token.type = TOKEN_NUMBER;
+        token.number = (float) (negative ? -result : result);
+        input = at;
+        return true;
+    }
+};
+
+// Binding strength of each operator, the same as PixelFun::precedence().
+constexpr uint8_t effectPrecedence(BinOpType op) {
+    switch (op) {
+        case BINOP_ADD:
+        case BINOP_SUB:
+            return 1;
+        case BINOP_OR:
+        case BINOP_AND:
+            return 2;
+        case BINOP_BIT_OR:
+        case BINOP_BIT_AND:
+        case BINOP_BIT_XOR:
+            return 3;
+        case BINOP_EQ:
+        case BINOP_NEQ:
+            return 4;
+        case BINOP_LTE:
+        case BINOP_GTE:
+        case BINOP_LT:
+        case BINOP_GT:
+            return 5;
+        case BINOP_LSHIFT:
+        case BINOP_RSHIFT:
+            return 6;
+        case BINOP_MUL:
+        case BINOP_DIV:
+        case BINOP_MOD:
+            return 7;
+        case BINOP_POW:
+            return 8;
+    }
+    return 0;
+}
+
+constexpr size_t effectLength(const char *source) {
+    size_t length = 0;
+    while (source[length]) {
+        length++;
+    }
+    return length;
+}
+
+// Parses source at compile time into at most capacity nodes, one more than
+// the length of the source always being enough. Mirrors
+// PixelFun::parseProgram() and fails with the same messages; the grammar
+// lives in both places, as the library itself has to stay C++11.
+template<size_t capacity>
+constexpr EffectTree<capacity> parseEffect(const char *source) {
+    struct Pending {
+        enum Kind : uint8_t { BINOP, GROUP, CALL } kind;
+        uint8_t op;
+        uint8_t arity;
+        uint8_t args;
+    };
+
+    EffectTree<capacity> tree = {};
+    EffectLexer lexer(source);
+    uint16_t values[PIXELFUN_PARSE_DEPTH] = {};
+    Pending pending[PIXELFUN_PARSE_DEPTH] = {};
+    size_t valueCount = 0;
+    size_t pendingCount = 0;
+    bool value = true;
+
+    while (true) {
+        EffectToken token = lexer.next(value);
+
+        if (value) {
+            EffectNode node = {};
+            switch (token.type) {
+                case TOKEN_NUMBER:
+                    node.type = EXPR_NUMBER;
+                    node.number = token.number;
+                    break;
+                case TOKEN_VAR:
+                    node.type = EXPR_VAR;
+                    node.op = token.op;
+                    node.deps = token.op == VAR_PI || token.op == VAR_TAU ? 0 : 1 << token.op;
+                    break;
+                case TOKEN_FUNC: {
+                    EffectToken open = lexer.next(true);
+                    if (open.type != TOKEN_OPEN) {
+                        return tree.fail("Expected '('", open.offset);
+                    }
+                    if (token.arity > 0) {
+                        if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                            return tree.fail("Nested too deeply", token.offset);
+                        }
+                        pending[pendingCount++] = {Pending::CALL, token.op, token.arity, 0};
+                        continue;
+                    }
+                    EffectToken close = lexer.next(false);
+                    if (close.type != TOKEN_CLOSE) {
+                        return tree.fail("Expected ')'", close.offset);
+                    }
+                    node.type = EXPR_FUNC;
+                    node.op = token.op;
+                    node.deps = DEP_RAND;
+                    break;
+                }
+                case TOKEN_OPEN:
+                    if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                        return tree.fail("Nested too deeply", token.offset);
+                    }
+                    pending[pendingCount++] = {Pending::GROUP, 0, 0, 0};
+                    continue;
+                case TOKEN_INVALID:
+                    return tree.fail(EffectLexer::alpha(source[token.offset]) ? "Unknown name" : "Unexpected character",
+                                     token.offset);
+                default:
+                    return tree.fail("Expected a value", token.offset);
+            }
+            if (valueCount == PIXELFUN_PARSE_DEPTH) {
+                return tree.fail("Nested too deeply", token.offset);
+            }
+            values[valueCount++] = tree.add(node);
+            value = false;
+            continue;
+        }
+
+        // Everything but another operator ends the operators pending
+        // since the innermost parenthesis or call.
+        uint8_t binding = token.type == TOKEN_BINOP ? effectPrecedence((BinOpType) token.op) : 0;
+        while (pendingCount && pending[pendingCount - 1].kind == Pending::BINOP &&
+               effectPrecedence((BinOpType) pending[pendingCount - 1].op) >= binding) {
+            EffectNode node = {};
+            node.type = EXPR_BINOP;
+            node.op = pending[--pendingCount].op;
+            node.arity = 2;
+            node.args[1] = values[--valueCount];
+            node.args[0] = values[valueCount - 1];
+            node.deps = tree.nodes[node.args[0]].deps | tree.nodes[node.args[1]].deps;
+            values[valueCount - 1] = tree.add(node);
+        }
+
+        Pending *top = pendingCount ? &pending[pendingCount - 1] : nullptr;
+        switch (token.type) {
+            case TOKEN_BINOP:
+                if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                    return tree.fail("Nested too deeply", token.offset);
+                }
+                pending[pendingCount++] = {Pending::BINOP, token.op, 0, 0};
+                value = true;
+                break;
+            case TOKEN_COMMA:
+                if (!top || top->kind != Pending::CALL || top->args + 1 == top->arity) {
+                    return tree.fail("Unexpected ','", token.offset);
+                }
+                top->args++;
+                value = true;
+                break;
+            case TOKEN_CLOSE:
+                if (!top) {
+                    return tree.fail("Unexpected ')'", token.offset);
+                }
+                if (top->kind == Pending::CALL) {
+                    if (top->args + 1 != top->arity) {
+                        return tree.fail("Expected ','", token.offset);
+                    }
+                    EffectNode call = {};
+                    call.type = EXPR_FUNC;
+                    call.op = top->op;
+                    call.arity = top->arity;
+                    valueCount -= top->arity;
+                    for (size_t arg = 0; arg < top->arity; arg++) {
+                        call.args[arg] = values[valueCount + arg];
+                        call.deps |= tree.nodes[call.args[arg]].deps;
+                    }
+                    values[valueCount++] = tree.add(call);
+                }
+                pendingCount--;
+                break;
+            case TOKEN_END:
+                if (top) {
+                    return tree.fail("Expected ')'", token.offset);
+                }
+                tree.root = values[0];
+                return tree;
+            case TOKEN_INVALID:
+                return tree.fail(EffectLexer::alpha(source[token.offset]) ? "Unknown name" : "Unexpected character",
+                                 token.offset);
+            default:
+                return tree.fail("Expected an operator", token.offset);
+        }
+    }
+}
+
+// Instantiated for a source that doesn't parse, so the compiler names the
+// byte offset it fails at. parseEffect<>(source).error says why.
+template<size_t errorOffset>
+struct EffectParseError {
+    static_assert(errorOffset == (size_t) -1, "Built-in effect doesn't parse, see errorOffset");
+};
+
+// Whether Ops can represent every number of the tree, see FixedOps.
+template<typename Ops, size_t capacity>
+constexpr bool effectInRange(const EffectTree<capacity> &tree) {
+    for (size_t n = 0; n < tree.count; n++) {
+        if (tree.nodes[n].type == EXPR_NUMBER && !Ops::inRange(tree.nodes[n].number)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The stages an effect is evaluated in, like the segments of a compiled
+// PixelFun program: once per frame, once per row and once per pixel.
+enum EffectStage : uint8_t {
+    EFFECT_FRAME = 1,
+    EFFECT_ROW,
+    EFFECT_PIXEL,
+};
+
+// Which nodes of an effect are evaluated ahead of the pixels, in the stage
+// they are in, and the slot their value is kept in. Nodes not hoisted are
+// stage 0.
+template<size_t capacity>
+struct EffectPlan {
+    uint8_t stage[capacity];
+    uint16_t slot[capacity];
+    size_t slotCount;
+};
+
+// Hoists the largest subtrees that only depend on t into the frame stage
+// and then those that only depend on t and y into the row stage, like
+// PixelFun::hoist(). Leaves and constant subtrees are left in place, the
+// compiler folds them anyway.
+template<size_t capacity>
+constexpr EffectPlan<capacity> planEffect(const EffectTree<capacity> &tree) {
+    EffectPlan<capacity> plan = {};
+    for (uint8_t stage = EFFECT_FRAME; stage <= EFFECT_ROW; stage++) {
+        uint8_t mask = stage == EFFECT_FRAME ? DEP_T : DEP_T | DEP_Y;
+        // Whether a node is part of a subtree hoisted already. Parents come
+        // after their children, so walking backwards visits them first.
+        bool covered[capacity] = {};
+        for (size_t n = tree.count; n-- > 0;) {
+            const EffectNode &node = tree.nodes[n];
+            if (!covered[n] && !plan.stage[n] && node.arity > 0 && node.deps && !(node.deps & ~mask)) {
+                plan.stage[n] = stage;
+                plan.slot[n] = (uint16_t) plan.slotCount++;
+            }
+            for (size_t arg = 0; arg < node.arity; arg++) {
+                covered[node.args[arg]] = covered[n] || plan.stage[n];
+            }
+        }
+    }
+    return plan;
+}
+
+// A built-in effect, evaluated with the operations of Backend so it gives
+// the same results as source installed into a PixelFun<..., Backend>.
+// Every node of the program is a call of node<>() specialized for it, which
+// leaves nothing but straight-line arithmetic once inlined. What only
+// depends on t or on t and y is evaluated once per frame or row, see
+// planEffect(); merging common subexpressions is left to the compiler.
+//
+// Effects have no state, any number of them can render at the same time.
+template<const char *source, typename Backend = ScalarBackend<> >
+class Effect {
+    typedef typename Backend::Scalar::Value Value;
+
+    static constexpr EffectTree<effectLength(source) + 1> tree = parseEffect<effectLength(source) + 1>(source);
+    static_assert(sizeof(EffectParseError<tree.error ? tree.errorOffset : (size_t) -1>) > 0, "");
+    static_assert(effectInRange<typename Backend::Scalar>(tree), "Built-in effect has a number out of range");
+    static constexpr EffectPlan<effectLength(source) + 1> plan = planEffect(tree);
+    static const size_t slotCount = plan.slotCount ? plan.slotCount : 1;
+
+public:
+    // How the effect can be rendered, see PixelFun::renderMode().
+    static constexpr RenderMode renderMode() {
+        uint8_t deps = tree.nodes[tree.root].deps;
+        if (deps & DEP_RAND) {
+            return RENDER_FULL;
+        }
+        if (!(deps & DEP_T)) {
+            return RENDER_STATIC;
+        }
+        return deps == DEP_T ? RENDER_UNIFORM : RENDER_FULL;
+    }
+
+    // Number of nodes in the effect, before the optimizer is done with them.
+    static constexpr size_t nodes() { return tree.count; }
+
+    float eval(float t, float i, float x, float y) const {
+        typedef typename Backend::Scalar Ops;
+        return Ops::toFloat(node<Ops, tree.root, EFFECT_FRAME>(Ops::fromFloat(t), Ops::fromFloat(i),
+                                                               Ops::fromFloat(x), Ops::fromFloat(y), nullptr));
+    }
+
+    // Like PixelFun::evalFrame().
+    void evalFrame(float t, size_t width, size_t height, float *out) const {
+        evalGrid(t, width, height, out);
+    }
+
+    void evalFrame(float t, size_t width, size_t height, uint8_t *out) const {
+        evalGrid(t, width, height, out);
+    }
+
+    // Like PixelFun::evalPoints().
+    template<typename Point, typename T>
+    void evalPoints(float t, const Point *points, size_t count, T *out) const {
+        typedef typename Backend::Scalar Ops;
+        Value slots[slotCount];
+        Value is[PIXELFUN_BLOCK_SIZE];
+        Value xs[PIXELFUN_BLOCK_SIZE];
+        Value values[PIXELFUN_BLOCK_SIZE];
+        Value frameTime = Ops::fromFloat(t);
+        Value row = 0;
+        if (uniform()) {
+            fill(frameTime, count, out);
+            return;
+        }
+        hoist<EFFECT_FRAME>(frameTime, 0, slots);
+        for (size_t n = 0; n < count;) {
+            if (n == 0 || points[n].y != points[n - 1].y) {
+                row = Ops::fromInt(points[n].y);
+                hoist<EFFECT_ROW>(frameTime, row, slots);
+            }
+            size_t m = 0;
+            do {
+                is[m] = Ops::fromInt(points[n + m].i);
+                xs[m] = Ops::fromInt(points[n + m].x);
+                m++;
+            } while (m < PIXELFUN_BLOCK_SIZE && n + m < count && points[n + m].y == points[n].y);
+            // The rest of a partial block repeats its last pixel.
+            for (size_t k = m; k < PIXELFUN_BLOCK_SIZE; k++) {
+                is[k] = is[m - 1];
+                xs[k] = xs[m - 1];
+            }
+            evalBlock(frameTime, is, xs, row, slots, values);
+            for (size_t k = 0; k < m; k++) {
+                convert(values[k], out[n + k]);
+            }
+            n += m;
+        }
+    }
+
+private:
+    // Whether every pixel of a frame has the same value.
+    static constexpr bool uniform() {
+        return (tree.nodes[tree.root].deps & (DEP_I | DEP_X | DEP_Y | DEP_RAND)) == 0;
+    }
+
+    template<typename T>
+    void evalGrid(float t, size_t width, size_t height, T *out) const {
+        typedef typename Backend::Scalar Ops;
+        Value slots[slotCount];
+        Value is[PIXELFUN_BLOCK_SIZE];
+        Value xs[PIXELFUN_BLOCK_SIZE];
+        Value values[PIXELFUN_BLOCK_SIZE];
+        Value frameTime = Ops::fromFloat(t);
+        if (uniform()) {
+            fill(frameTime, width * height, out);
+            return;
+        }
+        hoist<EFFECT_FRAME>(frameTime, 0, slots);
+        for (size_t y = 0; y < height; y++) {
+            Value row = Ops::fromInt(y);
+            hoist<EFFECT_ROW>(frameTime, row, slots);
+            for (size_t x = 0; x < width; x += PIXELFUN_BLOCK_SIZE) {
+                size_t n = width - x < PIXELFUN_BLOCK_SIZE ? width - x : PIXELFUN_BLOCK_SIZE;
+                for (size_t k = 0; k < PIXELFUN_BLOCK_SIZE; k++) {
+                    is[k] = Ops::fromInt(y * width + x + k);
+                    xs[k] = Ops::fromInt(x + k);
+                }
+                evalBlock(frameTime, is, xs, row, slots, values);
+                for (size_t k = 0; k < n; k++) {
+                    convert(values[k], out[y * width + x + k]);
+                }
+            }
+        }
+    }
+
+    template<typename T>
+    void fill(Value t, size_t count, T *out) const {
+        typedef typename Backend::Scalar Ops;
+        T converted;
+        convert(node<Ops, tree.root, EFFECT_FRAME>(t, 0, 0, 0, nullptr), converted);
+        for (size_t n = 0; n < count; n++) {
+            out[n] = converted;
+        }
+    }
+
+    static void convert(Value value, float &out) {
+        out = Backend::Scalar::toFloat(value);
+    }
+
+    static void convert(Value value, uint8_t &out) {
+        out = Backend::Scalar::quantize(value);
+    }
+
+    // Evaluates the nodes hoisted into stage and stores them in their slots.
+    template<uint8_t stage>
+    static void hoist(Value t, Value y, Value *slots) {
+        hoist<stage>(t, y, slots, std::make_index_sequence<tree.count>());
+    }
+
+    template<uint8_t stage, size_t... n>
+    static void hoist(Value t, Value y, Value *slots, std::index_sequence<n...>) {
+        (hoistNode<stage, n>(t, y, slots), ...);
+    }
+
+    template<uint8_t stage, size_t n>
+    static void hoistNode(Value t, Value y, Value *slots) {
+        typedef typename Backend::Scalar Ops;
+        if constexpr (plan.stage[n] == stage) {
+            slots[plan.slot[n]] = node<Ops, n, stage>(t, 0, 0, y, slots);
+        }
+    }
+
+    // Runs the pixel stage for PIXELFUN_BLOCK_SIZE pixels on row y, the
+    // k-th of them at x = x[k] with index i[k].
+    static void evalBlock(Value t, const Value *i, const Value *x, Value y, const Value *slots, Value *out) {
+        typedef typename Backend::Vector Ops;
+        for (size_t k = 0; k < PIXELFUN_BLOCK_SIZE; k += Ops::lanes) {
+            Ops::store(node<Ops, tree.root, EFFECT_PIXEL>(Ops::splat(t), Ops::load(i + k), Ops::load(x + k),
+                                                          Ops::splat(y), slots),
+                       out + k);
+        }
+    }
+
+    // The value of node n for the pixels in i, x and y, evaluated in stage.
+    // Nodes hoisted into an earlier stage are loaded from their slot.
+    template<typename Ops, size_t n, uint8_t stage>
+    static typename Ops::Vec node(typename Ops::Vec t, typename Ops::Vec i, typename Ops::Vec x,
+                                  typename Ops::Vec y, const Value *slots) {
+        typedef typename Ops::Vec Vec;
+        constexpr EffectNode expr = tree.nodes[n];
+        if constexpr (plan.stage[n] != 0 && plan.stage[n] < stage) {
+            return Ops::splat(slots[plan.slot[n]]);
+        } else if constexpr (expr.type == EXPR_NUMBER) {
+            return Ops::splat(Backend::Scalar::fromFloat(expr.number));
+        } else if constexpr (expr.type == EXPR_VAR) {
+            switch (expr.op) {
+                case VAR_T:
+                    return t;
+                case VAR_I:
+                    return i;
+                case VAR_X:
+                    return x;
+                case VAR_Y:
+                    return y;
+                case VAR_PI:
+                    return Ops::splat(Backend::Scalar::fromFloat(PIXELFUN_PI));
+                default:
+                    return Ops::splat(Backend::Scalar::fromFloat(2 * PIXELFUN_PI));
+            }
+        } else if constexpr (expr.arity == 0) {
+            return Ops::random();
+        } else if constexpr (expr.arity == 1) {
+            return func<Ops>((FuncType) expr.op, node<Ops, expr.args[0], stage>(t, i, x, y, slots), Vec());
+        } else {
+            // Left before right, so rand() is called in the same order as by
+            // the interpreter.
+            Vec a = node<Ops, expr.args[0], stage>(t, i, x, y, slots);
+            Vec b = node<Ops, expr.args[1], stage>(t, i, x, y, slots);
+            return expr.type == EXPR_FUNC ? func<Ops>((FuncType) expr.op, a, b) : binOp<Ops>((BinOpType) expr.op, a, b);
+        }
+    }
+
+    template<typename Ops>
+    static typename Ops::Vec binOp(BinOpType op, typename Ops::Vec a, typename Ops::Vec b) {
+        switch (op) {
+            case BINOP_POW:
+                return Ops::pow(a, b);
+            case BINOP_MOD:
+                return Ops::mod(a, b);
+            case BINOP_ADD:
+                return Ops::add(a, b);
+            case BINOP_SUB:
+                return Ops::sub(a, b);
+            case BINOP_MUL:
+                return Ops::mul(a, b);
+            case BINOP_DIV:
+                return Ops::div(a, b);
+            case BINOP_LSHIFT:
+                return Ops::lshift(a, b);
+            case BINOP_RSHIFT:
+                return Ops::rshift(a, b);
+            case BINOP_LTE:
+                return Ops::lte(a, b);
+            case BINOP_GTE:
+                return Ops::gte(a, b);
+            case BINOP_LT:
+                return Ops::lt(a, b);
+            case BINOP_GT:
+                return Ops::gt(a, b);
+            case BINOP_EQ:
+                return Ops::eq(a, b);
+            case BINOP_NEQ:
+                return Ops::neq(a, b);
+            case BINOP_OR:
+                return Ops::logicalOr(a, b);
+            case BINOP_BIT_OR:
+                return Ops::bitOr(a, b);
+            case BINOP_AND:
+                return Ops::logicalAnd(a, b);
+            case BINOP_BIT_AND:
+                return Ops::bitAnd(a, b);
+            case BINOP_BIT_XOR:
+                return Ops::bitXor(a, b);
+        }
+        return a;
+    }
+
+    // Functions of one argument ignore b.
+    template<typename Ops>
+    static typename Ops::Vec func(FuncType func, typename Ops::Vec a, typename Ops::Vec b) {
+        switch (func) {
+            case FUNC_SIN:
+                return Ops::sin(a);
+            case FUNC_COS:
+                return Ops::cos(a);
+            case FUNC_TAN:
+                return Ops::tan(a);
+            case FUNC_ASIN:
+                return Ops::asin(a);
+            case FUNC_ACOS:
+                return Ops::acos(a);
+            case FUNC_ATAN:
+                return Ops::atan(a);
+            case FUNC_ATAN2:
+                return Ops::atan2(a, b);
+            case FUNC_ASINH:
+                return Ops::asinh(a);
+            case FUNC_ACOSH:
+                return Ops::acosh(a);
+            case FUNC_ATANH:
+                return Ops::atanh(a);
+            case FUNC_FLOOR:
+                return Ops::floor(a);
+            case FUNC_CEIL:
+                return Ops::ceil(a);
+            case FUNC_ROUND:
+                return Ops::round(a);
+            case FUNC_FRACT:
+                return Ops::fract(a);
+            case FUNC_TRUNC:
+                return Ops::trunc(a);
+            case FUNC_HYPOT:
+                return Ops::hypot(a, b);
+            default:
+                return Ops::random();
+        }
+    }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef ARDUINO
+#include <chrono>
+#include <thread>
+#endif
+
+// Receives finished frames, for example to push them to an LED strip.
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+
+    // pixels holds count pixels of 3 bytes in strip order, each in the
+    // strip's wire format, see WireFormat in Palette.h.
+    virtual void write(const uint8_t *pixels, size_t count) = 0;
+};
+
+// Hands frames from a renderer to an output stage through two buffers, so
+// frame N + 1 can be rendered while frame N is still being sent out.
+//
+// One thread renders and one thread outputs. Neither ever waits for a lock:
+// when the other side still holds the buffer it needs, beginRender() and
+// beginOutput() return nullptr and the caller decides how to wait. Frames
+// are output in the order they were rendered and none are dropped.
+template<size_t pixel_count>
+class FramePipeline {
+public:
+    static const size_t frameSize = pixel_count * 3;
+
+    FramePipeline() : renderIndex(0), outputIndex(0) {
+        full[0].store(false);
+        full[1].store(false);
+    }
+
+    // Returns the buffer the next frame should be rendered into, or nullptr
+    // if both buffers are still waiting to be output.
+    uint8_t *beginRender() {
+        return full[renderIndex].load(std::memory_order_acquire) ? nullptr : buffers[renderIndex];
+    }
+
+    // Publishes the frame rendered into the buffer from beginRender().
+    void endRender() {
+        full[renderIndex].store(true, std::memory_order_release);
+        renderIndex ^= 1;
+    }
+
+    // Returns the oldest rendered frame, or nullptr if there is none.
+    const uint8_t *beginOutput() {
+        return full[outputIndex].load(std::memory_order_acquire) ? buffers[outputIndex] : nullptr;
+    }
+
+    // Hands the buffer from beginOutput() back to the renderer.
+    void endOutput() {
+        full[outputIndex].store(false, std::memory_order_release);
+        outputIndex ^= 1;
+    }
+
+    // Writes the oldest rendered frame to sink. Returns false if there was
+    // no frame to write.
+    bool output(FrameSink &sink) {
+        const uint8_t *pixels = beginOutput();
+        if (!pixels) {
+            return false;
+        }
+        sink.write(pixels, pixel_count);
+        endOutput();
+        return true;
+    }
+
+private:
+    uint8_t buffers[2][frameSize];
+    std::atomic<bool> full[2];
+    // Each index is only ever touched by one side.
+    size_t renderIndex;
+    size_t outputIndex;
+};
+
+#ifndef ARDUINO
+
+// Stands in for a WS2812 strip on the host. Every write takes as long as
+// the transfer would on the wire, 30 us per pixel at 800 kHz plus the
+// latch, and the last frame is kept so it can be inspected.
+class SimulatedSink : public FrameSink {
+public:
+    explicit SimulatedSink(uint32_t microsPerPixel = 30, uint32_t latchMicros = 80)
+        : microsPerPixel(microsPerPixel), latchMicros(latchMicros), frames(0), pixels(0), last(nullptr),
+          lastCount(0) {}
+
+    ~SimulatedSink() override { delete[] last; }
+
+    void write(const uint8_t *data, size_t count) override {
+        std::chrono::steady_clock::time_point done =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(microsPerPixel * count + latchMicros);
+        if (count != lastCount) {
+            delete[] last;
+            last = new uint8_t[count * 3];
+            lastCount = count;
+        }
+        memcpy(last, data, count * 3);
+        frames++;
+        pixels += count;
+        std::this_thread::sleep_until(done);
+    }
+
+    // Number of frames written so far.
+    uint64_t frameCount() const { return frames; }
+
+    // Number of pixels written so far.
+    uint64_t pixelCount() const { return pixels; }
+
+    // The most recently written frame, or nullptr before the first write.
+    const uint8_t *lastFrame() const { return last; }
+
+private:
+    uint32_t microsPerPixel;
+    uint32_t latchMicros;
+    uint64_t frames;
+    uint64_t pixels;
+    uint8_t *last;
+    size_t lastCount;
+};
+
+#endif
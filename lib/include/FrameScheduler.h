@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+
+// Seconds after which t wraps around to 0, or 0 to never wrap it. Up to an
+// hour, a float t is within a quarter of a millisecond of the exact time, a
+// small fraction of a frame; past a day it is off by half a frame at 60 fps.
+// Wrapping keeps it that precise, but makes every program whose periods
+// don't divide the wrap jump once per wrap, so it is off unless asked for.
+#ifndef PIXELFUN_TIME_WRAP
+#define PIXELFUN_TIME_WRAP 0
+#endif
+
+struct FrameStats {
+    // Frames begun since the scheduler was created.
+    uint32_t frames;
+    // Frames that began more than half a frame after their deadline.
+    uint32_t late;
+    // Deadlines that passed without a frame, because rendering fell behind.
+    uint32_t skipped;
+    // Frames per second actually achieved over the last full second.
+    float fps;
+};
+
+// Paces frames against absolute deadlines on a monotonic microsecond clock,
+// so time spent rendering and sending a frame doesn't slow the animation
+// down. Frame n is due at start + n / frameRate, and its t is derived from n
+// as well, so neither deadlines nor t accumulate rounding errors over long
+// uptimes. When rendering can't keep up, frames whose deadline has fully
+// passed are skipped and the animation keeps its speed.
+//
+// Time is kept in whole microseconds and only converted to float once it
+// has wrapped, if it does, see setTimeWrap(). Programs whose periods divide
+// the wrap, such as fract(t), t%8 or sin(tau*t/60) with a wrap of an hour,
+// carry on seamlessly across it; others jump once per wrap.
+//
+// The clock is passed in by the caller, esp_timer_get_time() on the ESP32.
+class FrameScheduler {
+public:
+    explicit FrameScheduler(uint32_t frameRate = 60)
+        : rate(frameRate ? frameRate : 1), wrap((uint64_t) PIXELFUN_TIME_WRAP * 1000000), origin(0), timeBase(0),
+          frame(0), windowStart(0), windowFrames(0), frameStats() {}
+
+    // Makes the next frame due at now, for example after a pause. t carries
+    // on from where it was.
+    void start(uint64_t now) {
+        timeBase = elapsed(frame);
+        origin = now;
+        frame = 0;
+        windowStart = now;
+        windowFrames = 0;
+    }
+
+    uint32_t frameRate() const { return rate; }
+
+    // Changes the frame rate from the next frame on without a jump in t.
+    void setFrameRate(uint32_t frameRate) {
+        if (!frameRate || frameRate == rate) {
+            return;
+        }
+        timeBase = elapsed(frame);
+        origin = deadline(frame);
+        frame = 0;
+        rate = frameRate;
+    }
+
+    // Wraps t around to 0 every seconds instead of after PIXELFUN_TIME_WRAP,
+    // or never if seconds is 0. Fixed point backends saturate at 32767 s, so
+    // they have to wrap by then.
+    void setTimeWrap(uint32_t seconds) { wrap = (uint64_t) seconds * 1000000; }
+
+    // Microseconds until the next frame is due, 0 if it is due already.
+    uint64_t timeUntilNextFrame(uint64_t now) const {
+        uint64_t due = deadline(frame);
+        return now < due ? due - now : 0;
+    }
+
+    // Begins the next frame and returns its t in seconds. Call this once the
+    // frame is due.
+    float beginFrame(uint64_t now) {
+        if (now >= deadline(frame + 1)) {
+            uint64_t due = (now - origin) * rate / 1000000;
+            frameStats.skipped += (uint32_t) (due - frame);
+            frame = due;
+        }
+        if (now > deadline(frame) + 500000 / rate) {
+            frameStats.late++;
+        }
+        frameStats.frames++;
+
+        windowFrames++;
+        if (now - windowStart >= 1000000) {
+            frameStats.fps = (float) windowFrames * 1000000.0f / (float) (now - windowStart);
+            windowStart = now;
+            windowFrames = 0;
+        }
+
+        uint64_t micros = elapsed(frame++);
+        if (wrap) {
+            micros %= wrap;
+        }
+        return (float) (micros / 1000000) + (float) (micros % 1000000) / 1000000.0f;
+    }
+
+    const FrameStats &stats() const { return frameStats; }
+
+private:
+    uint32_t rate;
+    uint64_t wrap;
+    // Clock time and animation time in microseconds at frame 0. Both move
+    // whenever the frame rate changes.
+    uint64_t origin;
+    uint64_t timeBase;
+    uint64_t frame;
+    uint64_t windowStart;
+    uint32_t windowFrames;
+    FrameStats frameStats;
+
+    uint64_t deadline(uint64_t n) const { return origin + n * 1000000 / rate; }
+
+    uint64_t elapsed(uint64_t n) const { return timeBase + n * 1000000 / rate; }
+};
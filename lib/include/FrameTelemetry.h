@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "LittleEndian.h"
+
+#ifndef PIXELFUN_TELEMETRY_FRAMES
+#define PIXELFUN_TELEMETRY_FRAMES 128
+#endif
+
+// Timings of a single frame in microseconds.
+struct FrameSample {
+    // Evaluating the program and filling the frame buffer.
+    uint32_t eval;
+    // Sending the previous frame to the strip.
+    uint32_t show;
+    // Waiting for a free buffer or the frame's deadline.
+    uint32_t idle;
+    // From the start of the previous frame to the start of this one.
+    uint32_t frame;
+    // Deadlines missed since the previous frame, late or skipped.
+    uint32_t missed;
+};
+
+// Summary of the frames currently held by FrameTelemetry, times in
+// microseconds.
+struct FrameReport {
+    uint32_t frames;
+    uint32_t missed;
+    uint32_t evalAverage;
+    uint32_t showAverage;
+    uint32_t idleAverage;
+    uint32_t frameMin;
+    uint32_t frameAverage;
+    uint32_t frameP99;
+
+    static const size_t encodedSize = 8 * sizeof(uint32_t);
+
+    // Writes the fields in declaration order as little endian integers, the
+    // format of the telemetry characteristic.
+    size_t encode(uint8_t *out) const {
+        const uint32_t fields[] = {frames,      missed,   evalAverage,  showAverage,
+                                   idleAverage, frameMin, frameAverage, frameP99};
+        for (size_t k = 0; k < 8; k++) {
+            writeLE32(out + 4 * k, fields[k]);
+        }
+        return encodedSize;
+    }
+};
+
+// Keeps the timings of the last PIXELFUN_TELEMETRY_FRAMES frames in a ring
+// buffer. Recording is a copy into the ring, so it can stay enabled in
+// production; report() walks the whole buffer and is meant to be called
+// about once a second. Samples are recorded and read from the render task
+// only.
+class FrameTelemetry {
+public:
+    FrameTelemetry() : next(0), count(0) {}
+
+    void record(const FrameSample &sample) {
+        samples[next] = sample;
+        next = (next + 1) % PIXELFUN_TELEMETRY_FRAMES;
+        if (count < PIXELFUN_TELEMETRY_FRAMES) {
+            count++;
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // Returns the sample recorded age frames ago, 0 being the newest.
+    const FrameSample &sample(size_t age) const {
+        return samples[(next + PIXELFUN_TELEMETRY_FRAMES - 1 - age) % PIXELFUN_TELEMETRY_FRAMES];
+    }
+
+    FrameReport report() const {
+        FrameReport report = {};
+        if (!count) {
+            return report;
+        }
+
+        uint64_t eval = 0, show = 0, idle = 0, frame = 0;
+        uint32_t frameTimes[PIXELFUN_TELEMETRY_FRAMES];
+        report.frameMin = UINT32_MAX;
+        for (size_t k = 0; k < count; k++) {
+            const FrameSample &s = samples[k];
+            eval += s.eval;
+            show += s.show;
+            idle += s.idle;
+            frame += s.frame;
+            report.missed += s.missed;
+            report.frameMin = std::min(report.frameMin, s.frame);
+            frameTimes[k] = s.frame;
+        }
+
+        size_t p99 = (count * 99 + 99) / 100 - 1;
+        std::nth_element(frameTimes, frameTimes + p99, frameTimes + count);
+
+        report.frames = count;
+        report.evalAverage = eval / count;
+        report.showAverage = show / count;
+        report.idleAverage = idle / count;
+        report.frameAverage = frame / count;
+        report.frameP99 = frameTimes[p99];
+        return report;
+    }
+
+private:
+    FrameSample samples[PIXELFUN_TELEMETRY_FRAMES];
+    size_t next;
+    size_t count;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// One LED of an installation: where it is on the strip and the x, y and i
+// the program sees for it.
+struct LayoutPoint {
+    uint16_t led;
+    uint16_t x;
+    uint16_t y;
+    uint16_t i;
+};
+
+enum LayoutFlags : uint8_t {
+    // Every other row of a panel runs the opposite way.
+    LAYOUT_SERPENTINE = 1 << 0,
+    // The first row of a panel runs right to left.
+    LAYOUT_MIRRORED = 1 << 1,
+    // Every other row of panels runs the opposite way.
+    LAYOUT_PANELS_SERPENTINE = 1 << 2,
+};
+
+// Rectangular panels of LEDs wired row by row, tiled panelsAcross by
+// panelsDown and chained one after another, row of panels by row of panels.
+// Sent over BLE as its six bytes in this order.
+struct GridLayout {
+    uint8_t panelWidth;
+    uint8_t panelHeight;
+    uint8_t panelsAcross;
+    uint8_t panelsDown;
+    // Quarter turns clockwise every panel is mounted at, 0 to 3.
+    uint8_t rotation;
+    // LayoutFlags.
+    uint8_t flags;
+};
+
+// The position of every LED, computed once when the layout is set, so
+// rendering a frame is a linear walk over a table without any index math.
+// Points are kept sorted by y and then x, the order in which
+// PixelFun::evalPoints() evaluates them fastest. i counts pixels row by
+// row across the whole canvas, like evalFrame() does.
+template<size_t capacity>
+class Layout {
+public:
+    Layout() : pointCount(0), canvasWidth(0), canvasHeight(0) {}
+
+    // Lays out the LEDs of a grid of panels. Returns false and leaves the
+    // layout alone if the grid is empty, has more than capacity LEDs or an
+    // invalid rotation.
+    bool setGrid(const GridLayout &grid) {
+        if (!fits(grid)) {
+            return false;
+        }
+        size_t panelSize = (size_t) grid.panelWidth * grid.panelHeight;
+        size_t count = panelSize * grid.panelsAcross * grid.panelsDown;
+
+        // Rotating a panel by a quarter turn swaps its width and height.
+        bool turned = grid.rotation % 2 != 0;
+        size_t width = turned ? grid.panelHeight : grid.panelWidth;
+        size_t height = turned ? grid.panelWidth : grid.panelHeight;
+        for (size_t led = 0; led < count; led++) {
+            size_t panel = led / panelSize;
+            size_t row = led % panelSize / grid.panelWidth;
+            size_t column = led % panelSize % grid.panelWidth;
+            if (((grid.flags & LAYOUT_MIRRORED) != 0) != ((grid.flags & LAYOUT_SERPENTINE) && row % 2)) {
+                column = grid.panelWidth - 1 - column;
+            }
+
+            size_t x, y;
+            switch (grid.rotation) {
+                case 0:
+                    x = column;
+                    y = row;
+                    break;
+                case 1:
+                    x = grid.panelHeight - 1 - row;
+                    y = column;
+                    break;
+                case 2:
+                    x = grid.panelWidth - 1 - column;
+                    y = grid.panelHeight - 1 - row;
+                    break;
+                default:
+                    x = row;
+                    y = grid.panelWidth - 1 - column;
+                    break;
+            }
+
+            size_t panelRow = panel / grid.panelsAcross;
+            size_t panelColumn = panel % grid.panelsAcross;
+            if ((grid.flags & LAYOUT_PANELS_SERPENTINE) && panelRow % 2) {
+                panelColumn = grid.panelsAcross - 1 - panelColumn;
+            }
+            x += panelColumn * width;
+            y += panelRow * height;
+
+            LayoutPoint &point = points[led];
+            point.led = (uint16_t) led;
+            point.x = (uint16_t) x;
+            point.y = (uint16_t) y;
+            point.i = (uint16_t) (y * width * grid.panelsAcross + x);
+        }
+        pointCount = count;
+        sort();
+        return true;
+    }
+
+    // Takes the positions of count LEDs as they are, for installations that
+    // aren't a grid. Returns false and leaves the layout alone if there are
+    // more than capacity points or one of them is past the end of the strip.
+    bool setPoints(const LayoutPoint *list, size_t count) {
+        if (count > capacity) {
+            return false;
+        }
+        for (size_t n = 0; n < count; n++) {
+            if (list[n].led >= capacity) {
+                return false;
+            }
+        }
+        std::copy(list, list + count, points);
+        pointCount = count;
+        sort();
+        return true;
+    }
+
+    // Whether setGrid() accepts the grid.
+    static bool fits(const GridLayout &grid) {
+        size_t count = (size_t) grid.panelWidth * grid.panelHeight * grid.panelsAcross * grid.panelsDown;
+        return count > 0 && count <= capacity && grid.rotation <= 3;
+    }
+
+    const LayoutPoint *begin() const { return points; }
+
+    const LayoutPoint *end() const { return points + pointCount; }
+
+    size_t size() const { return pointCount; }
+
+    // Size of the canvas the points are on, one more than the largest x and
+    // y.
+    size_t width() const { return canvasWidth; }
+
+    size_t height() const { return canvasHeight; }
+
+private:
+    LayoutPoint points[capacity];
+    size_t pointCount;
+    size_t canvasWidth;
+    size_t canvasHeight;
+
+    void sort() {
+        std::sort(points, points + pointCount, [](const LayoutPoint &a, const LayoutPoint &b) {
+            return a.y != b.y ? a.y < b.y : a.x < b.x;
+        });
+        canvasWidth = 0;
+        canvasHeight = 0;
+        for (size_t n = 0; n < pointCount; n++) {
+            canvasWidth = std::max(canvasWidth, (size_t) points[n].x + 1);
+            canvasHeight = std::max(canvasHeight, (size_t) points[n].y + 1);
+        }
+    }
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The little endian integers of encoded programs, the program store and the
+// BLE characteristics, read and written byte by byte so the byte order of
+// the CPU doesn't matter.
+
+inline uint16_t readLE16(const uint8_t *in) {
+    return (uint16_t) (in[0] | in[1] << 8);
+}
+
+inline uint32_t readLE32(const uint8_t *in) {
+    return (uint32_t) in[0] | (uint32_t) in[1] << 8 | (uint32_t) in[2] << 16 | (uint32_t) in[3] << 24;
+}
+
+inline void writeLE16(uint8_t *out, uint16_t value) {
+    out[0] = (uint8_t) value;
+    out[1] = (uint8_t) (value >> 8);
+}
+
+inline void writeLE32(uint8_t *out, uint32_t value) {
+    for (size_t b = 0; b < 4; b++) {
+        out[b] = (uint8_t) (value >> (8 * b));
+    }
+}
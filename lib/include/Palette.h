@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef PIXELFUN_PALETTE_STOPS
+#define PIXELFUN_PALETTE_STOPS 8
+#endif
+
+// A color at one point of a gradient. position is a quantized program value
+// as produced by PixelFun::quantize(), 0 standing for -1 and 255 for 1.
+struct PaletteStop {
+    uint8_t position;
+    uint8_t color[3];
+};
+
+static_assert(sizeof(PaletteStop) == 4, "Gradients are sent as 4 bytes per stop");
+
+// How a strip takes its pixels on the wire, which is how Adafruit_NeoPixel
+// keeps them in its buffer: scaled by the brightness and in the strip's
+// color order. Only strips with 3 bytes per pixel are supported.
+struct WireFormat {
+    // Brightness as Adafruit_NeoPixel::setBrightness() stores it, plus one,
+    // with 0 meaning full brightness.
+    uint8_t scale;
+    // Position of red, green and blue within a pixel.
+    uint8_t rOffset;
+    uint8_t gOffset;
+    uint8_t bOffset;
+
+    // Plain r, g, b bytes at full brightness.
+    static WireFormat rgb() {
+        WireFormat format = {0, 0, 1, 2};
+        return format;
+    }
+
+    // The format of an Adafruit_NeoPixel strip of the given type, NEO_GRB
+    // for example, after setBrightness(brightness).
+    static WireFormat neoPixel(uint16_t type, uint8_t brightness) {
+        WireFormat format = {(uint8_t) (brightness + 1), (uint8_t) ((type >> 4) & 3), (uint8_t) ((type >> 2) & 3),
+                             (uint8_t) (type & 3)};
+        return format;
+    }
+
+    // Writes one pixel exactly like Adafruit_NeoPixel::setPixelColor().
+    void encode(uint8_t r, uint8_t g, uint8_t b, uint8_t *out) const {
+        if (scale) {
+            r = (r * scale) >> 8;
+            g = (g * scale) >> 8;
+            b = (b * scale) >> 8;
+        }
+        out[rOffset] = r;
+        out[gOffset] = g;
+        out[bOffset] = b;
+    }
+};
+
+// Maps the quantized values of PixelFun::evalFrame() to colors through a
+// table with an entry for each of the 256 values, so coloring a pixel is a
+// lookup and a copy no matter how the colors were defined. The table is
+// only rebuilt when the colors change, which takes about as long as
+// coloring 256 pixels the slow way.
+//
+// Entries are kept in the strip's wire format, so brightness and color
+// order cost nothing per pixel either and frames can be copied to the strip
+// as they are.
+class Palette {
+public:
+    Palette() : table(), format(WireFormat::rgb()) {}
+
+    // Sets the format the next setColors() or setGradient() builds the
+    // table in, plain r, g, b bytes until then.
+    void setOutput(const WireFormat &output) { format = output; }
+
+    // The look of PixelFun::interpolateColors(): positive values fade from
+    // black to color1, negative ones from black to color2.
+    void setColors(const uint8_t color1[3], const uint8_t color2[3]) {
+        for (size_t value = 0; value < 256; value++) {
+            float v = value / 127.5f - 1.0f;
+            const uint8_t *color = v > 0 ? color1 : color2;
+            float scale = v > 0 ? v : -v;
+            format.encode((uint8_t) ((float) color[0] * scale), (uint8_t) ((float) color[1] * scale),
+                          (uint8_t) ((float) color[2] * scale), table[value]);
+        }
+    }
+
+    // A gradient through count stops, sorted by position. Values are
+    // interpolated linearly between the two stops around them, and values
+    // outside the first and last stop take their color. Returns false and
+    // leaves the table alone if there are no stops, more than
+    // PIXELFUN_PALETTE_STOPS or they are out of order.
+    bool setGradient(const PaletteStop *stops, size_t count) {
+        if (!isGradient(stops, count)) {
+            return false;
+        }
+
+        size_t next = 0;
+        for (size_t value = 0; value < 256; value++) {
+            while (next < count && stops[next].position < value) {
+                next++;
+            }
+            if (next == 0 || next == count) {
+                const uint8_t *color = stops[next == 0 ? 0 : count - 1].color;
+                format.encode(color[0], color[1], color[2], table[value]);
+                continue;
+            }
+            // stops[next - 1] is below value and stops[next] at or above.
+            const PaletteStop &a = stops[next - 1];
+            const PaletteStop &b = stops[next];
+            unsigned span = b.position - a.position;
+            unsigned offset = value - a.position;
+            uint8_t color[3];
+            for (size_t c = 0; c < 3; c++) {
+                color[c] = (uint8_t) ((a.color[c] * (span - offset) + b.color[c] * offset + span / 2) / span);
+            }
+            format.encode(color[0], color[1], color[2], table[value]);
+        }
+        return true;
+    }
+
+    // Whether setGradient() accepts the stops.
+    static bool isGradient(const PaletteStop *stops, size_t count) {
+        if (count == 0 || count > PIXELFUN_PALETTE_STOPS) {
+            return false;
+        }
+        for (size_t s = 1; s < count; s++) {
+            if (stops[s].position < stops[s - 1].position) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Color of a quantized value in the output format.
+    const uint8_t *operator[](uint8_t value) const { return table[value]; }
+
+    // Colors count quantized values into count pixels of 3 bytes.
+    void apply(const uint8_t *values, size_t count, uint8_t *rgb) const {
+        for (size_t n = 0; n < count; n++) {
+            memcpy(rgb + 3 * n, table[values[n]], 3);
+        }
+    }
+
+private:
+    uint8_t table[256][3];
+    WireFormat format;
+};
@@ -1,19 +1,46 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <stack>
 #include <cctype>
 #include <cstring>
 #include <tuple>
 
-enum ExprType {
+#include "LittleEndian.h"
+#include "Platform.h"
+
+#ifndef PIXELFUN_STACK_SIZE
+#define PIXELFUN_STACK_SIZE 32
+#endif
+
+#ifndef PIXELFUN_BLOCK_SIZE
+#define PIXELFUN_BLOCK_SIZE 8
+#endif
+
+#ifndef PIXELFUN_MAX_SLOTS
+#define PIXELFUN_MAX_SLOTS 16
+#endif
+
+// Values a compiled segment computes once and uses more than once per pixel.
+#ifndef PIXELFUN_MAX_LOCALS
+#define PIXELFUN_MAX_LOCALS 8
+#endif
+
+#ifndef PIXELFUN_PARSE_DEPTH
+#define PIXELFUN_PARSE_DEPTH 32
+#endif
+
+enum ExprType : uint8_t {
     EXPR_NUMBER,
     EXPR_BINOP,
     EXPR_VAR,
     EXPR_FUNC,
 };
 
-enum BinOpType {
+enum BinOpType : uint8_t {
     BINOP_POW,
     BINOP_MOD,
     BINOP_ADD,
@@ -35,7 +62,7 @@ enum BinOpType {
     BINOP_BIT_XOR
 };
 
-enum Var {
+enum Var : uint8_t {
     VAR_T,
     VAR_I,
     VAR_X,
@@ -44,7 +71,26 @@ enum Var {
     VAR_TAU,
 };
 
-enum FuncType {
+// The inputs a node depends on. Nodes that only depend on t are the same for
+// the whole frame, nodes that depend on t and y are the same for a whole row.
+enum Dependency : uint8_t {
+    DEP_T = 1 << VAR_T,
+    DEP_I = 1 << VAR_I,
+    DEP_X = 1 << VAR_X,
+    DEP_Y = 1 << VAR_Y,
+    DEP_RAND = 1 << 4,
+};
+
+// The cheapest way to render a program, see PixelFun::renderMode().
+enum RenderMode : uint8_t {
+    // Doesn't depend on t or rand(), so every frame is the same.
+    RENDER_STATIC,
+    // Only depends on t, so every pixel of a frame is the same.
+    RENDER_UNIFORM,
+    RENDER_FULL,
+};
+
+enum FuncType : uint8_t {
     FUNC_RAND,
     FUNC_RANDOM,
     FUNC_SIN,
@@ -65,101 +111,2120 @@ enum FuncType {
     FUNC_HYPOT,
 };
 
+// Number of arguments a function takes.
+inline uint8_t funcArity(FuncType func) {
+    switch (func) {
+        case FUNC_RAND:
+        case FUNC_RANDOM:
+            return 0;
+        case FUNC_ATAN2:
+        case FUNC_HYPOT:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Nodes refer to their children by index into the node array of their
+// PixelFun instance.
+typedef uint16_t ExprIndex;
+
+static const ExprIndex NO_EXPR = 0xFFFF;
+
 struct Expr {
     ExprType type;
+    uint8_t deps;
     union {
-        float number;
+        BinOpType op;
+        FuncType func;
         Var var;
-        struct {
-            BinOpType op;
-            Expr *a;
-            Expr *b;
-        } binop;
-        struct {
-            FuncType func;
-            Expr *args[2];
-            size_t arity;
-        } funcCall;
     };
-} typedef Expr;
+    // Number of children, 2 for binary operators.
+    uint8_t arity;
+    union {
+        float number;
+        ExprIndex args[2];
+    };
+};
 
-template<size_t desired_capacity>
-class PixelFun {
-private:
-    Expr pool[desired_capacity];
-    size_t freeIndices[desired_capacity];
-    size_t stackTop;
-    Expr *root;
+static_assert(sizeof(Expr) == 8, "Expr is expected to pack into 8 bytes");
+
+// Opcodes of the compiled program. The binop and function ranges mirror the
+// order of BinOpType and FuncType so the compiler can map them by offset.
+enum OpCode : uint8_t {
+    OP_NUMBER,
+    OP_T,
+    OP_I,
+    OP_X,
+    OP_Y,
+    OP_POW,
+    OP_MOD,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LSHIFT,
+    OP_RSHIFT,
+    OP_LTE,
+    OP_GTE,
+    OP_LT,
+    OP_GT,
+    OP_EQ,
+    OP_NEQ,
+    OP_OR,
+    OP_BIT_OR,
+    OP_AND,
+    OP_BIT_AND,
+    OP_BIT_XOR,
+    OP_RAND,
+    OP_RANDOM,
+    OP_SIN,
+    OP_COS,
+    OP_TAN,
+    OP_ASIN,
+    OP_ACOS,
+    OP_ATAN,
+    OP_ATAN2,
+    OP_ASINH,
+    OP_ACOSH,
+    OP_ATANH,
+    OP_FLOOR,
+    OP_CEIL,
+    OP_ROUND,
+    OP_FRACT,
+    OP_TRUNC,
+    OP_HYPOT,
+    OP_DUP,
+    OP_LOAD,
+    OP_STORE,
+    OP_TEE,
+    OP_LOCAL,
+};
 
-public:
-    PixelFun() : pool(), stackTop(desired_capacity), freeIndices(), root(nullptr) {
-        for (size_t i = 0; i < desired_capacity; i++) {
-            freeIndices[i] = i;
+template<typename Value>
+struct Instr {
+    OpCode op;
+    union {
+        Value number;
+        uint8_t slot;
+        // Only used by PixelFun::share() and compact(), before anything is
+        // compiled.
+        ExprIndex node[2];
+    };
+};
+
+// Math policies implement the transcendental builtins and the operators that
+// would otherwise need libm. FloatOps and VectorOps take one as a template
+// parameter. VectorOps only uses its own polynomials for sin, cos, tan, atan
+// and atan2 with policies that set polynomial, and otherwise calls the
+// policy lane by lane, so every backend gives the same results with it.
+
+// Uses libm exactly like the tree interpreter always has. Only hypot avoids
+// pow() and double precision, which gives the same result up to rounding.
+struct ExactMath {
+    static const bool polynomial = false;
+
+    static float sin(float a) { return sinf(a); }
+
+    static float cos(float a) { return cosf(a); }
+
+    static float tan(float a) { return tanf(a); }
+
+    static float asin(float a) { return asinf(a); }
+
+    static float acos(float a) { return acosf(a); }
+
+    static float atan(float a) { return atanf(a); }
+
+    static float atan2(float a, float b) { return atan2f(a, b); }
+
+    static float asinh(float a) { return asinhf(a); }
+
+    static float acosh(float a) { return acoshf(a); }
+
+    static float atanh(float a) { return atanhf(a); }
+
+    static float hypot(float a, float b) { return sqrtf(a * a + b * b); }
+
+    static float pow(float a, float b) { return ::pow(a, b); }
+
+    static float mod(float a, float b) { return fmod(a, b); }
+};
+
+// Calls the single precision libm functions only, so nothing is promoted to
+// double on FPUs that only handle floats, and skips pow() for the common
+// exponents 0, 1, 2 and 0.5. Results match ExactMath within a few ULPs.
+struct FastMath : ExactMath {
+    static float pow(float a, float b) {
+        if (b == 2) {
+            return a * a;
+        } else if (b == 1) {
+            return a;
+        } else if (b == 0) {
+            return 1;
+        } else if (b == 0.5f && a > 0) {
+            return sqrtf(a);
         }
+        return powf(a, b);
     }
 
-    std::tuple<uint8_t, uint8_t, uint8_t> interpolateColors(uint8_t a[3], uint8_t b[3], float t) {
-        t = fminf(fmaxf(t, -1.0f), 1.0f);
-        if (t > 0.0) {
-            return std::tuple<uint8_t, uint8_t, uint8_t>{(uint8_t) ((float) a[0] * t), (uint8_t) ((float) a[1] * t),
-                                                         (uint8_t) ((float) a[2] * t)};
-        } else if (t < 1.0) {
-            return std::tuple<uint8_t, uint8_t, uint8_t>{(uint8_t) ((float) b[0] * -t), (uint8_t) ((float) b[1] * -t),
-                                                         (uint8_t) ((float) b[2] * -t)};
-        } else {
-            return std::tuple<uint8_t, uint8_t, uint8_t>{0, 0, 0};
+    static float mod(float a, float b) { return fmodf(a, b); }
+};
+
+// Polynomial approximations. Maximum errors, measured against libm on the
+// host:
+//   sin, cos          4e-6 absolute, for |x| < 5e4 (libm beyond)
+//   tan               4e-6 relative, away from the poles
+//   atan, atan2       3e-7 absolute
+//   asin, acos        3e-7 absolute
+//   asinh, acosh      1e-6 absolute
+//   atanh             4e-7 absolute
+//   pow               6e-6 relative, for a > 0 and results below 1e30
+//   mod               1 ULP of max(|a|, |b|), except right at the wrap
+//                     around point, where it may return 0 instead of b
+// Negative or non-finite pow bases and other special cases fall back to libm,
+// so they behave like ExactMath.
+struct ApproxMath {
+    static const bool polynomial = true;
+
+    // Past 5e4, k * pi no longer splits exactly, see reducePi().
+    static float sin(float a) {
+        if (!(fabsf(a) < 5e4f)) {
+            return sinf(a);
         }
+        int32_t k = (int32_t) (a * 0.318309886f + (a < 0 ? -0.5f : 0.5f));
+        float s = sinPoly(reducePi(a, (float) k));
+        return k & 1 ? -s : s;
     }
 
-    bool parse(const char *expr) {
-        if (root != nullptr) {
-            dealloc();
+    static float cos(float a) {
+        if (!(fabsf(a) < 5e4f)) {
+            return cosf(a);
         }
-        const char *rest = parseExpr(expr, root);
-        if (rest && *rest == '\0') {
-            return true;
+        int32_t k = (int32_t) (a * 0.318309886f + (a < 0 ? -0.5f : 0.5f));
+        float c = cosPoly(reducePi(a, (float) k));
+        return k & 1 ? -c : c;
+    }
+
+    static float tan(float a) { return sin(a) / cos(a); }
+
+    static float asin(float a) { return atan2(a, sqrtf((1 - a) * (1 + a))); }
+
+    static float acos(float a) { return atan2(sqrtf((1 - a) * (1 + a)), a); }
+
+    // Cephes atanf: reduce to |x| <= tan(pi/8) and use a degree 9 polynomial.
+    static float atan(float a) {
+        float x = fabsf(a);
+        float offset = 0;
+        if (x > 2.414213562f) {
+            offset = 1.570796327f;
+            x = -1.0f / x;
+        } else if (x > 0.414213562f) {
+            offset = 0.785398163f;
+            x = (x - 1.0f) / (x + 1.0f);
         }
-        dealloc();
-        return false;
+        float z = x * x;
+        float result = offset + ((((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z -
+                                  3.33329491539e-1f) * z * x + x);
+        return a < 0 ? -result : result;
     }
 
-    float eval(float t, float i, float x, float y) {
-        return eval(root, t, i, x, y);
+    static float atan2(float a, float b) {
+        if (b > 0) {
+            return atan(a / b);
+        } else if (b < 0) {
+            return atan(a / b) + (a < 0 ? -3.141592654f : 3.141592654f);
+        } else if (b == 0 && a != 0) {
+            return a < 0 ? -1.570796327f : 1.570796327f;
+        }
+        return atan2f(a, b);
+    }
+
+    static float asinh(float a) {
+        float x = fabsf(a);
+        if (!(x < 1e9f)) {
+            return asinhf(a);
+        }
+        float result = log(x + sqrtf(x * x + 1));
+        return a < 0 ? -result : result;
+    }
+
+    static float acosh(float a) {
+        if (!(a >= 1) || !(a < 1e9f)) {
+            return acoshf(a);
+        }
+        return log(a + sqrtf(a * a - 1));
+    }
+
+    static float atanh(float a) { return 0.5f * log((1 + a) / (1 - a)); }
+
+    static float hypot(float a, float b) { return sqrtf(a * a + b * b); }
+
+    static float pow(float a, float b) {
+        if (b == 2) {
+            return a * a;
+        } else if (b == 1) {
+            return a;
+        } else if (b == 0) {
+            return 1;
+        } else if (!(a > 0) || !(a < 1e30f) || !(fabsf(b) < 1e30f)) {
+            return powf(a, b);
+        }
+        return exp2(b * log2(a));
+    }
+
+    static float mod(float a, float b) {
+        if (b == 0 || !(fabsf(a) < 1e30f)) {
+            return fmodf(a, b);
+        }
+        float r = a - b * truncf(a / b);
+        if (r != 0 && (r < 0) != (a < 0)) {
+            r += a < 0 ? -fabsf(b) : fabsf(b);
+        } else if (fabsf(r) >= fabsf(b)) {
+            r -= a < 0 ? -fabsf(b) : fabsf(b);
+        }
+        return r;
+    }
+
+    // sin(r) for r in [-pi/2, pi/2], Taylor series up to r^9.
+    static float sinPoly(float r) {
+        float r2 = r * r;
+        return r + r * r2 * (-1.6666667e-1f + r2 * (8.3333333e-3f + r2 * (-1.9841270e-4f + r2 * 2.7557319e-6f)));
+    }
+
+    // cos(r) for r in [-pi/2, pi/2], Taylor series up to r^10. Exactly 1 at
+    // 0.
+    static float cosPoly(float r) {
+        float r2 = r * r;
+        return 1 + r2 * (-0.5f + r2 * (4.1666667e-2f + r2 * (-1.3888889e-3f + r2 * (2.4801587e-5f +
+                                                                                r2 * -2.7557319e-7f))));
+    }
+
+    // Splits a - k * pi into three parts so the product stays exact for
+    // |k| < 2^14 without relying on fused multiply-add.
+    static float reducePi(float a, float k) {
+        return ((a - k * 3.140625f) - k * 9.67502593994140625e-4f) - k * 1.509958025e-7f;
+    }
+
+    // log2(a) for finite a > 0: split off the exponent and evaluate
+    // ln(m) = 2 * atanh((m - 1) / (m + 1)) for m in [sqrt(1/2), sqrt(2)).
+    static float log2(float a) {
+        if (!(a >= 1.17549435e-38f) || !(a < 1e30f)) {
+            return log2f(a);
+        }
+        uint32_t bits;
+        memcpy(&bits, &a, sizeof(bits));
+        int32_t exponent = (int32_t) (bits >> 23) - 127;
+        bits = (bits & 0x007fffff) | 0x3f800000;
+        float m;
+        memcpy(&m, &bits, sizeof(m));
+        if (m > 1.414213562f) {
+            m *= 0.5f;
+            exponent++;
+        }
+        float s = (m - 1) / (m + 1);
+        float s2 = s * s;
+        float ln = 2 * s * (1 + s2 * (0.333333333f + s2 * (0.2f + s2 * (0.142857143f + s2 * 0.111111111f))));
+        return (float) exponent + ln * 1.442695041f;
+    }
+
+    static float log(float a) { return log2(a) * 0.693147181f; }
+
+    // 2^a: split into an integer exponent and a fraction in [-0.5, 0.5] and
+    // evaluate e^(f * ln 2) with a degree 6 Taylor series.
+    static float exp2(float a) {
+        if (!(a < 128)) {
+            return a != a ? a : INFINITY;
+        } else if (!(a > -126)) {
+            return 0;
+        }
+        int32_t k = (int32_t) (a + (a < 0 ? -0.5f : 0.5f));
+        float g = (a - (float) k) * 0.693147181f;
+        float e = 1 + g * (1 + g * (0.5f + g * (1.66666667e-1f + g * (4.16666667e-2f + g * (8.33333333e-3f +
+                                                                                               g * 1.38888889e-3f)))));
+        uint32_t bits = (uint32_t) (k + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return e * scale;
+    }
+};
+
+// Scalar implementation of every instruction. Backends evaluate single
+// pixels and the frame and row segments with these, and the tree
+// interpreter uses them as well.
+template<typename Math = ExactMath>
+struct FloatOps {
+    typedef float Value;
+    typedef float Vec;
+    static const size_t lanes = 1;
+
+    static Value fromFloat(float value) { return value; }
+
+    static Value fromInt(int32_t value) { return (float) value; }
+
+    // Every number a program can contain.
+    static constexpr bool inRange(float) { return true; }
+
+    // Integers up to 2^24 are exact, so is i on canvases of that many pixels.
+    static const int32_t maxInt = 1 << 24;
+
+    static float toFloat(Value value) { return value; }
+
+    // Clamps to [-1, 1] and maps the result to a byte, with 0 standing for -1
+    // and 255 for 1.
+    static uint8_t quantize(Value value) {
+        value = fminf(fmaxf(value, -1.0f), 1.0f);
+        return (uint8_t) ((value + 1.0f) * 127.5f + 0.5f);
+    }
+
+    static Vec splat(Value value) { return value; }
+
+    static Vec load(const Value *values) { return values[0]; }
+
+    static void store(Vec value, Value *out) { out[0] = value; }
+
+    static Value extract(Vec value) { return value; }
+
+    static Vec random() { return (float) Platform::random(RAND_MAX) / (float) RAND_MAX; }
+
+    static Vec pow(Vec a, Vec b) { return Math::pow(a, b); }
+
+    static Vec mod(Vec a, Vec b) { return Math::mod(a, b); }
+
+    static Vec add(Vec a, Vec b) { return a + b; }
+
+    static Vec sub(Vec a, Vec b) { return a - b; }
+
+    static Vec mul(Vec a, Vec b) { return a * b; }
+
+    static Vec div(Vec a, Vec b) { return b == 0 ? 0 : a / b; }
+
+    static Vec lshift(Vec a, Vec b) { return (float) ((int) a << (int) b); }
+
+    static Vec rshift(Vec a, Vec b) { return (float) ((int) a >> (int) b); }
+
+    static Vec lte(Vec a, Vec b) { return a <= b ? 1.0 : 0.0; }
+
+    static Vec gte(Vec a, Vec b) { return a >= b ? 1.0 : 0.0; }
+
+    static Vec lt(Vec a, Vec b) { return a < b ? 1.0 : 0.0; }
+
+    static Vec gt(Vec a, Vec b) { return a > b ? 1.0 : 0.0; }
+
+    static Vec eq(Vec a, Vec b) { return a == b ? 1.0 : 0.0; }
+
+    static Vec neq(Vec a, Vec b) { return a != b ? 1.0 : 0.0; }
+
+    static Vec logicalOr(Vec a, Vec b) { return (a == 1.0 || b == 1.0) ? 1.0 : 0.0; }
+
+    static Vec bitOr(Vec a, Vec b) { return (float) ((int) a | (int) b); }
+
+    static Vec logicalAnd(Vec a, Vec b) { return (a == 1.0 && b == 1.0) ? 1.0 : 0.0; }
+
+    static Vec bitAnd(Vec a, Vec b) { return (float) ((int) a & (int) b); }
+
+    static Vec bitXor(Vec a, Vec b) { return (float) ((int) a ^ (int) b); }
+
+    static Vec sin(Vec a) { return Math::sin(a); }
+
+    static Vec cos(Vec a) { return Math::cos(a); }
+
+    static Vec tan(Vec a) { return Math::tan(a); }
+
+    static Vec asin(Vec a) { return Math::asin(a); }
+
+    static Vec acos(Vec a) { return Math::acos(a); }
+
+    static Vec atan(Vec a) { return Math::atan(a); }
+
+    static Vec atan2(Vec a, Vec b) { return Math::atan2(a, b); }
+
+    static Vec asinh(Vec a) { return Math::asinh(a); }
+
+    static Vec acosh(Vec a) { return Math::acosh(a); }
+
+    static Vec atanh(Vec a) { return Math::atanh(a); }
+
+    static Vec floor(Vec a) { return floorf(a); }
+
+    static Vec ceil(Vec a) { return ceilf(a); }
+
+    static Vec round(Vec a) { return roundf(a); }
+
+    static Vec fract(Vec a) { return a - truncf(a); }
+
+    static Vec trunc(Vec a) { return truncf(a); }
+
+    static Vec hypot(Vec a, Vec b) { return Math::hypot(a, b); }
+};
+
+// Evaluates one pixel at a time. This is the default backend.
+template<typename MathPolicy = ExactMath>
+struct ScalarBackend {
+    typedef MathPolicy Math;
+    typedef FloatOps<Math> Scalar;
+    typedef FloatOps<Math> Vector;
+};
+
+#if defined(__GNUC__)
+
+#ifndef PIXELFUN_VECTOR_LANES
+#define PIXELFUN_VECTOR_LANES 4
+#endif
+
+// Evaluates PIXELFUN_VECTOR_LANES pixels per operation using GCC vector
+// extensions, which map to SSE/AVX or NEON on the host. Targets without
+// vector registers, including the Xtensa cores of the ESP32 family, get the
+// same code lowered to scalar instructions.
+//
+// Comparisons and selects are branch free, and so are the rounding
+// functions. With ApproxMath, sin, cos, tan, atan and atan2 are evaluated on
+// whole vectors; sin and cos are accurate to about 5e-7 for |x| < 5e4 and
+// use libm for lanes beyond that. All other functions, and these ones with
+// the other policies, fall back to FloatOps lane by lane.
+template<typename Math = ExactMath>
+struct VectorOps {
+    typedef float Vec __attribute__((vector_size(PIXELFUN_VECTOR_LANES * sizeof(float))));
+    typedef int32_t Mask __attribute__((vector_size(PIXELFUN_VECTOR_LANES * sizeof(int32_t))));
+    static const size_t lanes = PIXELFUN_VECTOR_LANES;
+
+    static Vec splat(float value) {
+        Vec result;
+        for (size_t k = 0; k < lanes; k++) {
+            result[k] = value;
+        }
+        return result;
+    }
+
+    static Vec load(const float *values) {
+        Vec result;
+        memcpy(&result, values, sizeof(result));
+        return result;
+    }
+
+    static void store(Vec value, float *out) { memcpy(out, &value, sizeof(value)); }
+
+    static float extract(Vec value) { return value[0]; }
+
+    static Vec select(Mask mask, Vec a, Vec b) { return (Vec) ((mask & (Mask) a) | (~mask & (Mask) b)); }
+
+    static Vec boolean(Mask mask) { return (Vec) (mask & (Mask) splat(1.0f)); }
+
+    static Vec random() {
+        Vec result;
+        for (size_t k = 0; k < lanes; k++) {
+            result[k] = FloatOps<Math>::random();
+        }
+        return result;
+    }
+
+    static Vec pow(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::pow(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec mod(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::mod(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec add(Vec a, Vec b) { return a + b; }
+
+    static Vec sub(Vec a, Vec b) { return a - b; }
+
+    static Vec mul(Vec a, Vec b) { return a * b; }
+
+    static Vec div(Vec a, Vec b) { return select(b == 0, splat(0), a / b); }
+
+    static Vec lshift(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::lshift(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec rshift(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::rshift(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec lte(Vec a, Vec b) { return boolean(a <= b); }
+
+    static Vec gte(Vec a, Vec b) { return boolean(a >= b); }
+
+    static Vec lt(Vec a, Vec b) { return boolean(a < b); }
+
+    static Vec gt(Vec a, Vec b) { return boolean(a > b); }
+
+    static Vec eq(Vec a, Vec b) { return boolean(a == b); }
+
+    static Vec neq(Vec a, Vec b) { return boolean(a != b); }
+
+    static Vec logicalOr(Vec a, Vec b) { return boolean((a == 1.0f) | (b == 1.0f)); }
+
+    static Vec bitOr(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::bitOr(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec logicalAnd(Vec a, Vec b) { return boolean((a == 1.0f) & (b == 1.0f)); }
+
+    static Vec bitAnd(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::bitAnd(a[k], b[k]);
+        }
+        return a;
+    }
+
+    static Vec bitXor(Vec a, Vec b) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::bitXor(a[k], b[k]);
+        }
+        return a;
+    }
+
+    // sin(r) for r in [-pi/2, pi/2], Taylor series up to r^11.
+    static Vec sinPoly(Vec r) {
+        Vec r2 = r * r;
+        Vec p = splat(-2.5052108e-8f);
+        p = p * r2 + 2.7557319e-6f;
+        p = p * r2 - 1.9841270e-4f;
+        p = p * r2 + 8.3333333e-3f;
+        p = p * r2 - 1.6666667e-1f;
+        return r + r * r2 * p;
+    }
+
+    // cos(r) for r in [-pi/2, pi/2], Taylor series up to r^12. Exactly 1 at
+    // 0.
+    static Vec cosPoly(Vec r) {
+        Vec r2 = r * r;
+        Vec p = splat(2.0876757e-9f);
+        p = p * r2 - 2.7557319e-7f;
+        p = p * r2 + 2.4801587e-5f;
+        p = p * r2 - 1.3888889e-3f;
+        p = p * r2 + 4.1666667e-2f;
+        p = p * r2 - 0.5f;
+        return 1.0f + r2 * p;
+    }
+
+    // Splits a - k * pi into three parts so the product stays exact for
+    // |k| < 2^14 without relying on fused multiply-add.
+    static Vec reducePi(Vec a, Vec k) {
+        return ((a - k * 3.140625f) - k * 9.67502593994140625e-4f) - k * 1.509958025e-7f;
+    }
+
+    // Lanes that reducePi() can't handle exactly, NaN and infinities
+    // included.
+    static Mask outOfRange(Vec a) { return ~(select(a < 0, -a, a) < 5e4f); }
+
+    static Vec sin(Vec a) {
+        if (!Math::polynomial) {
+            for (size_t k = 0; k < lanes; k++) {
+                a[k] = Math::sin(a[k]);
+            }
+            return a;
+        }
+        Vec k = round(a * 0.318309886f);
+        Vec r = sinPoly(reducePi(a, k));
+        Mask odd = fract(k * 0.5f) != 0;
+        Vec result = select(odd, -r, r);
+        Mask far = outOfRange(a);
+        for (size_t n = 0; n < lanes; n++) {
+            if (far[n]) {
+                result[n] = sinf(a[n]);
+            }
+        }
+        return result;
+    }
+
+    static Vec cos(Vec a) {
+        if (!Math::polynomial) {
+            for (size_t k = 0; k < lanes; k++) {
+                a[k] = Math::cos(a[k]);
+            }
+            return a;
+        }
+        Vec k = round(a * 0.318309886f);
+        Vec r = cosPoly(reducePi(a, k));
+        Mask odd = fract(k * 0.5f) != 0;
+        Vec result = select(odd, -r, r);
+        Mask far = outOfRange(a);
+        for (size_t n = 0; n < lanes; n++) {
+            if (far[n]) {
+                result[n] = cosf(a[n]);
+            }
+        }
+        return result;
+    }
+
+    static Vec tan(Vec a) {
+        if (!Math::polynomial) {
+            for (size_t k = 0; k < lanes; k++) {
+                a[k] = Math::tan(a[k]);
+            }
+            return a;
+        }
+        return sin(a) / cos(a);
+    }
+
+    static Vec asin(Vec a) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::asin(a[k]);
+        }
+        return a;
+    }
+
+    static Vec acos(Vec a) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::acos(a[k]);
+        }
+        return a;
+    }
+
+    // Cephes atanf: reduce to |x| <= tan(pi/8) and use a degree 9 polynomial.
+    static Vec atan(Vec a) {
+        if (!Math::polynomial) {
+            for (size_t k = 0; k < lanes; k++) {
+                a[k] = Math::atan(a[k]);
+            }
+            return a;
+        }
+        Mask negative = a < 0;
+        Vec x = select(negative, -a, a);
+        Mask large = x > 2.414213562f;
+        Mask medium = ~large & (x > 0.414213562f);
+        Vec offset = select(large, splat(1.570796327f), select(medium, splat(0.785398163f), splat(0)));
+        x = select(large, -1.0f / x, select(medium, (x - 1.0f) / (x + 1.0f), x));
+        Vec z = x * x;
+        Vec p = splat(8.05374449538e-2f);
+        p = p * z - 1.38776856032e-1f;
+        p = p * z + 1.99777106478e-1f;
+        p = p * z - 3.33329491539e-1f;
+        Vec result = offset + (p * z * x + x);
+        return select(negative, -result, result);
+    }
+
+    static Vec atan2(Vec a, Vec b) {
+        if (!Math::polynomial) {
+            for (size_t k = 0; k < lanes; k++) {
+                a[k] = Math::atan2(a[k], b[k]);
+            }
+            return a;
+        }
+        Vec result = atan(a / b);
+        Mask signBit = (Mask) a & (Mask) splat(-0.0f);
+        Vec pi = (Vec) ((Mask) splat(3.141592654f) | signBit);
+        result = select(b < 0, result + pi, result);
+        return select((a == 0) & (b == 0), splat(0), result);
+    }
+
+    static Vec asinh(Vec a) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::asinh(a[k]);
+        }
+        return a;
+    }
+
+    static Vec acosh(Vec a) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::acosh(a[k]);
+        }
+        return a;
+    }
+
+    static Vec atanh(Vec a) {
+        for (size_t k = 0; k < lanes; k++) {
+            a[k] = FloatOps<Math>::atanh(a[k]);
+        }
+        return a;
+    }
+
+    // Truncates through an integer conversion. Values of 2^23 and above are
+    // already integral and are passed through, as is the sign of zero.
+    static Vec trunc(Vec a) {
+        Mask sign = (Mask) a & (Mask) splat(-0.0f);
+        Mask large = ((Mask) a & ~sign) >= (Mask) splat(8388608.0f);
+        Vec small = select(large, splat(0), a);
+        Vec result;
+        for (size_t k = 0; k < lanes; k++) {
+            result[k] = (float) (int32_t) small[k];
+        }
+        return select(large, a, (Vec) ((Mask) result | sign));
+    }
+
+    static Vec floor(Vec a) {
+        Vec t = trunc(a);
+        return select(t > a, t - 1.0f, t);
+    }
+
+    static Vec ceil(Vec a) {
+        Vec t = trunc(a);
+        return select(t < a, t + 1.0f, t);
+    }
+
+    static Vec round(Vec a) {
+        Vec t = trunc(a);
+        Vec d = a - t;
+        Vec one = (Vec) ((Mask) splat(1.0f) | ((Mask) a & (Mask) splat(-0.0f)));
+        return select((d >= 0.5f) | (d <= -0.5f), t + one, t);
+    }
+
+    static Vec fract(Vec a) { return a - trunc(a); }
+
+    static Vec hypot(Vec a, Vec b) {
+        Vec sum = a * a + b * b;
+        for (size_t k = 0; k < lanes; k++) {
+            sum[k] = sqrtf(sum[k]);
+        }
+        return sum;
+    }
+};
+
+// Evaluates blocks of pixels with VectorOps. Single pixels and the frame and
+// row segments still go through FloatOps.
+template<typename MathPolicy = ExactMath>
+struct VectorBackend {
+    typedef MathPolicy Math;
+    typedef FloatOps<Math> Scalar;
+    typedef VectorOps<Math> Vector;
+};
+
+#endif
+
+// Q16.16 fixed point implementation of every instruction, for targets
+// without an FPU such as the RISC-V core of the ESP32-C3. Only parsing,
+// constant folding and the conversions at the edges of a frame touch
+// floats.
+//
+// Values saturate at about +-32768 instead of overflowing. Programs can't
+// contain numbers outside that range, i is only right on canvases of up to
+// 32768 pixels and t goes wrong after about 9 hours unless it wraps earlier,
+// see FrameScheduler::setTimeWrap(). Division or
+// modulo by zero yields 0 like in FloatOps, and so do arguments outside a
+// function's domain, which would give NaN with floats. Shifts and bitwise
+// operators work on the integer part. The transcendental functions are
+// polynomial approximations within 3e-5 of libm, about two units of the
+// last fractional bit; pow and the inverse hyperbolic functions stay within
+// 5e-5 relative.
+struct FixedOps {
+    typedef int32_t Value;
+    typedef int32_t Vec;
+    static const size_t lanes = 1;
+
+    static const int32_t one = 1 << 16;
+    static const int32_t halfPi = 102944;
+    static const int32_t pi = 205887;
+    static const int32_t ln2 = 45426;
+
+    static Value saturate(int64_t value) {
+        return value > INT32_MAX ? INT32_MAX : value < -INT32_MAX ? -INT32_MAX : (Value) value;
+    }
+
+    static Value fromFloat(float value) {
+        if (!(value == value)) {
+            return 0;
+        }
+        value *= (float) one;
+        if (value >= 2147483520.0f) {
+            return INT32_MAX;
+        } else if (value <= -2147483520.0f) {
+            return -INT32_MAX;
+        }
+        return (Value) (value + (value < 0 ? -0.5f : 0.5f));
+    }
+
+    static Value fromInt(int32_t value) { return saturate((int64_t) value * one); }
+
+    static constexpr bool inRange(float value) { return value > -32768.0f && value < 32768.0f; }
+
+    static const int32_t maxInt = 32767;
+
+    static float toFloat(Value value) { return (float) value / (float) one; }
+
+    static uint8_t quantize(Value value) {
+        value = value < -one ? -one : value > one ? one : value;
+        return (uint8_t) (((int64_t) (value + one) * 255 + one) / (2 * one));
+    }
+
+    static Vec splat(Value value) { return value; }
+
+    static Vec load(const Value *values) { return values[0]; }
+
+    static void store(Vec value, Value *out) { out[0] = value; }
+
+    static Value extract(Vec value) { return value; }
+
+    static Vec random() { return (Value) Platform::random(one); }
+
+    static Vec pow(Vec a, Vec b) {
+        if (b == 0) {
+            return one;
+        } else if (a == 0) {
+            return b > 0 ? 0 : INT32_MAX;
+        } else if ((b & (one - 1)) == 0) {
+            int32_t n = b < 0 ? -(b / one) : b / one;
+            Value result = one;
+            for (Value base = a; n != 0; n >>= 1) {
+                if (n & 1) {
+                    result = mul(result, base);
+                }
+                base = mul(base, base);
+            }
+            return b < 0 ? (result == 0 ? INT32_MAX : div(one, result)) : result;
+        } else if (a < 0) {
+            return 0;
+        }
+        return exp2(mul(b, log2(a)));
+    }
+
+    static Vec mod(Vec a, Vec b) { return b == 0 ? 0 : (Value) ((int64_t) a % b); }
+
+    static Vec add(Vec a, Vec b) { return saturate((int64_t) a + b); }
+
+    static Vec sub(Vec a, Vec b) { return saturate((int64_t) a - b); }
+
+    static Vec mul(Vec a, Vec b) { return saturate(((int64_t) a * b) >> 16); }
+
+    static Vec div(Vec a, Vec b) { return b == 0 ? 0 : saturate((int64_t) a * one / b); }
+
+    static Vec lshift(Vec a, Vec b) { return fromInt((int32_t) ((uint32_t) (a / one) << ((b / one) & 31))); }
+
+    static Vec rshift(Vec a, Vec b) { return fromInt((a / one) >> ((b / one) & 31)); }
+
+    static Vec lte(Vec a, Vec b) { return a <= b ? one : 0; }
+
+    static Vec gte(Vec a, Vec b) { return a >= b ? one : 0; }
+
+    static Vec lt(Vec a, Vec b) { return a < b ? one : 0; }
+
+    static Vec gt(Vec a, Vec b) { return a > b ? one : 0; }
+
+    static Vec eq(Vec a, Vec b) { return a == b ? one : 0; }
+
+    static Vec neq(Vec a, Vec b) { return a != b ? one : 0; }
+
+    static Vec logicalOr(Vec a, Vec b) { return (a == one || b == one) ? one : 0; }
+
+    static Vec bitOr(Vec a, Vec b) { return fromInt((a / one) | (b / one)); }
+
+    static Vec logicalAnd(Vec a, Vec b) { return (a == one && b == one) ? one : 0; }
+
+    static Vec bitAnd(Vec a, Vec b) { return fromInt((a / one) & (b / one)); }
+
+    static Vec bitXor(Vec a, Vec b) { return fromInt((a / one) ^ (b / one)); }
+
+    static Vec sin(Vec a) {
+        // One turn maps to the full range of phase, the top two bits select
+        // the quadrant.
+        return sinPhase((uint32_t) (((int64_t) a * 683565276) >> 16));
+    }
+
+    static Vec cos(Vec a) { return sinPhase((uint32_t) (((int64_t) a * 683565276) >> 16) + 0x40000000u); }
+
+    static Vec tan(Vec a) { return div(sin(a), cos(a)); }
+
+    static Vec asin(Vec a) {
+        if (a > one || a < -one) {
+            return 0;
+        }
+        return atan2(a, squareRoot((int64_t) one * one - (int64_t) a * a));
+    }
+
+    static Vec acos(Vec a) {
+        if (a > one || a < -one) {
+            return 0;
+        }
+        return atan2(squareRoot((int64_t) one * one - (int64_t) a * a), a);
+    }
+
+    static Vec atan(Vec a) { return atan2(a, one); }
+
+    static Vec atan2(Vec a, Vec b) {
+        int64_t y = a < 0 ? -(int64_t) a : a;
+        int64_t x = b < 0 ? -(int64_t) b : b;
+        if (x == 0 && y == 0) {
+            return 0;
+        }
+        Value result = y <= x ? atanUnit((y << 30) / x) : halfPi - atanUnit((x << 30) / y);
+        if (b < 0) {
+            result = pi - result;
+        }
+        return a < 0 ? -result : result;
+    }
+
+    static Vec asinh(Vec a) {
+        int64_t x = a < 0 ? -(int64_t) a : a;
+        Value result = x > 128 * one ? add(ln(saturate(x)), ln2) : ln(saturate(x + hypot(saturate(x), one)));
+        return a < 0 ? -result : result;
+    }
+
+    static Vec acosh(Vec a) {
+        if (a < one) {
+            return 0;
+        } else if (a > 128 * one) {
+            return add(ln(a), ln2);
+        }
+        return ln(saturate((int64_t) a + squareRoot((int64_t) a * a - (int64_t) one * one)));
+    }
+
+    static Vec atanh(Vec a) {
+        if (a >= one || a <= -one) {
+            return a == one ? INT32_MAX : a == -one ? -INT32_MAX : 0;
+        }
+        return ln(div(one + a, one - a)) / 2;
+    }
+
+    static Vec floor(Vec a) { return saturate((int64_t) a & ~(int64_t) (one - 1)); }
+
+    static Vec ceil(Vec a) { return saturate(((int64_t) a + one - 1) & ~(int64_t) (one - 1)); }
+
+    static Vec round(Vec a) { return a < 0 ? -trunc(saturate(-(int64_t) a + one / 2)) : trunc(saturate((int64_t) a + one / 2)); }
+
+    static Vec fract(Vec a) { return a - trunc(a); }
+
+    static Vec trunc(Vec a) { return a < 0 ? -(-a & ~(one - 1)) : a & ~(one - 1); }
+
+    static Vec hypot(Vec a, Vec b) {
+        return squareRoot((uint64_t) ((int64_t) a * a) + (uint64_t) ((int64_t) b * b));
+    }
+
+private:
+    // The polynomials are evaluated with 30 fractional bits so that only the
+    // final result is rounded to 16.
+    static int64_t mulQ30(int64_t a, int64_t b) { return (a * b + (1 << 29)) >> 30; }
+
+    static int64_t horner(const int32_t *coefficients, size_t count, int64_t x) {
+        int64_t result = coefficients[count - 1];
+        for (size_t k = count - 1; k-- > 0;) {
+            result = coefficients[k] + mulQ30(result, x);
+        }
+        return result;
+    }
+
+    static Value toQ16(int64_t value) { return (Value) ((value + (1 << 13)) >> 14); }
+
+    // sin(x * pi / 2) for x in [0, 1].
+    static Value sinQuadrant(int64_t x) {
+        static const int32_t coefficients[] = {1686624008, -693522194, 85292042, -4652668};
+        x <<= 14;
+        return toQ16(mulQ30(horner(coefficients, 4, mulQ30(x, x)), x));
+    }
+
+    static Value sinPhase(uint32_t phase) {
+        int64_t x = ((phase & 0x3FFFFFFF) + 0x2000) >> 14;
+        switch (phase >> 30) {
+            case 0:
+                return sinQuadrant(x);
+            case 1:
+                return sinQuadrant(one - x);
+            case 2:
+                return -sinQuadrant(x);
+            default:
+                return -sinQuadrant(one - x);
+        }
+    }
+
+    // atan(x) for x in [0, 1] with 30 fractional bits.
+    static Value atanUnit(int64_t x) {
+        static const int32_t coefficients[] = {1073717369, -357151174, 207813263,
+                                               -125014243, 56532197,   -12584345};
+        return toQ16(mulQ30(horner(coefficients, 6, mulQ30(x, x)), x));
+    }
+
+    // Square root of a value with 32 fractional bits, the result has 16.
+    static Value squareRoot(uint64_t value) {
+        uint64_t result = 0;
+        uint64_t bit = (uint64_t) 1 << 62;
+        while (bit > value) {
+            bit >>= 2;
+        }
+        while (bit != 0) {
+            if (value >= result + bit) {
+                value -= result + bit;
+                result = (result >> 1) + bit;
+            } else {
+                result >>= 1;
+            }
+            bit >>= 2;
+        }
+        return saturate((int64_t) result);
+    }
+
+    static Value squareRoot(int64_t value) { return value <= 0 ? 0 : squareRoot((uint64_t) value); }
+
+    static Value log2(Value a) {
+        static const int32_t coefficients[] = {1548929668, -771249758, 492066877,
+                                               -300157302, 132560763,  -28410654};
+        if (a <= 0) {
+            return -INT32_MAX;
+        }
+        int32_t msb = 31 - __builtin_clz((uint32_t) a);
+        int64_t m = msb >= 30 ? (int64_t) a >> (msb - 30) : (int64_t) a << (30 - msb);
+        int64_t f = m - (1 << 30);
+        return (Value) ((int64_t) (msb - 16) * one + toQ16(mulQ30(horner(coefficients, 6, f), f)));
+    }
+
+    static Value exp2(Value a) {
+        static const int32_t coefficients[] = {1073741824, 744266797, 257862135, 59953295, 9635192, 2024277};
+        int32_t k = a >> 16;
+        if (k >= 15) {
+            return INT32_MAX;
+        } else if (k <= -32) {
+            return 0;
+        }
+        int64_t p = horner(coefficients, 6, (int64_t) (a & (one - 1)) << 14);
+        return saturate(k == 14 ? p : (p + ((int64_t) 1 << (13 - k))) >> (14 - k));
+    }
+
+    static Value ln(Value a) { return a <= 0 ? -INT32_MAX : (Value) (((int64_t) log2(a) * ln2) >> 16); }
+};
+
+// Evaluates everything in Q16.16 fixed point with FixedOps. Constant folding
+// still uses the math policy.
+struct FixedBackend {
+    typedef ExactMath Math;
+    typedef FixedOps Scalar;
+    typedef FixedOps Vector;
+};
+
+// Programs can also be exchanged in a compact binary form, so a device can
+// install a precompiled program without parsing any text. An encoded
+// program is a header followed by one record per node:
+//
+//   'P' 'F'      magic
+//   version      PROGRAM_FORMAT_VERSION
+//   checksum     programChecksum() of all records, 4 bytes little endian
+//   records...
+//
+// Records list the nodes in reverse Polish notation. The first byte holds the
+// RecordKind in its top three bits and the BinOpType, Var or FuncType in the
+// other five. Operators and functions take their operands from the values
+// before them, numbers are followed by their value and references by the
+// index of the earlier node they repeat, which lets nodes be shared. All
+// multi-byte values are little endian.
+static const uint8_t PROGRAM_FORMAT_VERSION = 1;
+static const size_t PROGRAM_HEADER_SIZE = 7;
+
+// The first four kinds match ExprType.
+enum RecordKind : uint8_t {
+    RECORD_NUMBER,
+    RECORD_BINOP,
+    RECORD_VAR,
+    RECORD_FUNC,
+    RECORD_REF,
+};
+
+static_assert(RECORD_FUNC == (RecordKind) EXPR_FUNC, "Record kinds must match expression types");
+
+// The integers 0 to 29 fit into the record byte itself, from NUMBER_SMALL on.
+// Other multiples of 1/256 between -128 and 128 are stored as a 16-bit
+// fraction, all remaining numbers as a 32-bit float.
+enum NumberRecord : uint8_t {
+    NUMBER_FLOAT,
+    NUMBER_FIXED,
+    NUMBER_SMALL,
+};
+
+// CRC-32 as used by zlib and PNG, computed bitwise to stay small.
+inline uint32_t programChecksum(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t n = 0; n < size; n++) {
+        crc ^= data[n];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+enum TokenType : uint8_t {
+    TOKEN_END,
+    TOKEN_NUMBER,
+    TOKEN_VAR,
+    TOKEN_FUNC,
+    TOKEN_BINOP,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+    TOKEN_COMMA,
+    TOKEN_INVALID,
+};
+
+struct Token {
+    TokenType type;
+    union {
+        BinOpType op;
+        FuncType func;
+        Var var;
+    };
+    // Number of arguments a function takes.
+    uint8_t arity;
+    float number;
+    // Offset of the token's first byte in the program.
+    size_t offset;
+};
+
+// Splits a program into tokens in a single pass over its bytes. Whether a +
+// or - is a sign or an operator depends on whether the parser expects a
+// value next, so it passes that along with every call.
+class Lexer {
+public:
+    explicit Lexer(const char *source) : source(source), input(source) {}
+
+    Token next(bool value) {
+        while (isspace((unsigned char) *input)) {
+            input++;
+        }
+
+        Token token;
+        token.type = TOKEN_INVALID;
+        token.op = BINOP_ADD;
+        token.arity = 0;
+        token.number = 0;
+        token.offset = input - source;
+
+        char c = *input;
+        if (c == '\0') {
+            token.type = TOKEN_END;
+            return token;
+        }
+        if (isdigit((unsigned char) c) || c == '.' || (value && (c == '+' || c == '-'))) {
+            char *end;
+            float number = strtof(input, &end);
+            if (end != input) {
+                token.type = TOKEN_NUMBER;
+                token.number = number;
+                input = end;
+                return token;
+            }
+        }
+        if (isalpha((unsigned char) c)) {
+            const char *name = input;
+            while (isalnum((unsigned char) *input) || *input == '_') {
+                input++;
+            }
+            keyword(name, input - name, token);
+            return token;
+        }
+
+        input++;
+        switch (c) {
+            case '(':
+                token.type = TOKEN_OPEN;
+                break;
+            case ')':
+                token.type = TOKEN_CLOSE;
+                break;
+            case ',':
+                token.type = TOKEN_COMMA;
+                break;
+            case '+':
+                binOp(token, BINOP_ADD);
+                break;
+            case '-':
+                binOp(token, BINOP_SUB);
+                break;
+            case '*':
+                binOp(token, follows('*') ? BINOP_POW : BINOP_MUL);
+                break;
+            case '/':
+                binOp(token, BINOP_DIV);
+                break;
+            case '%':
+                binOp(token, BINOP_MOD);
+                break;
+            case '<':
+                binOp(token, follows('<') ? BINOP_LSHIFT : follows('=') ? BINOP_LTE : BINOP_LT);
+                break;
+            case '>':
+                binOp(token, follows('>') ? BINOP_RSHIFT : follows('=') ? BINOP_GTE : BINOP_GT);
+                break;
+            case '=':
+                if (follows('=')) {
+                    binOp(token, BINOP_EQ);
+                }
+                break;
+            case '!':
+                if (follows('=')) {
+                    binOp(token, BINOP_NEQ);
+                }
+                break;
+            case '|':
+                binOp(token, follows('|') ? BINOP_OR : BINOP_BIT_OR);
+                break;
+            case '&':
+                binOp(token, follows('&') ? BINOP_AND : BINOP_BIT_AND);
+                break;
+            case '^':
+                binOp(token, BINOP_BIT_XOR);
+                break;
+        }
+        return token;
+    }
+
+private:
+    const char *source;
+    const char *input;
+
+    // Consumes c if it is the next byte.
+    bool follows(char c) {
+        if (*input != c) {
+            return false;
+        }
+        input++;
+        return true;
+    }
+
+    static void binOp(Token &token, BinOpType op) {
+        token.type = TOKEN_BINOP;
+        token.op = op;
+    }
+
+    static void var(Token &token, Var var) {
+        token.type = TOKEN_VAR;
+        token.var = var;
+    }
+
+    static void func(Token &token, FuncType func) {
+        token.type = TOKEN_FUNC;
+        token.func = func;
+        token.arity = funcArity(func);
+    }
+
+    // Looks a name up by its length and first byte, so at most a couple of
+    // candidates are ever compared. Unknown names leave the token invalid.
+    static void keyword(const char *name, size_t length, Token &token) {
+        switch (length) {
+            case 1:
+                switch (name[0]) {
+                    case 't':
+                        return var(token, VAR_T);
+                    case 'i':
+                        return var(token, VAR_I);
+                    case 'x':
+                        return var(token, VAR_X);
+                    case 'y':
+                        return var(token, VAR_Y);
+                }
+                return;
+            case 2:
+                if (!memcmp(name, "pi", 2)) {
+                    return var(token, VAR_PI);
+                }
+                return;
+            case 3:
+                switch (name[0]) {
+                    case 'c':
+                        if (!memcmp(name, "cos", 3)) return func(token, FUNC_COS);
+                        return;
+                    case 's':
+                        if (!memcmp(name, "sin", 3)) return func(token, FUNC_SIN);
+                        return;
+                    case 't':
+                        if (!memcmp(name, "tan", 3)) return func(token, FUNC_TAN);
+                        if (!memcmp(name, "tau", 3)) return var(token, VAR_TAU);
+                        return;
+                }
+                return;
+            case 4:
+                switch (name[0]) {
+                    case 'a':
+                        if (!memcmp(name, "asin", 4)) return func(token, FUNC_ASIN);
+                        if (!memcmp(name, "acos", 4)) return func(token, FUNC_ACOS);
+                        if (!memcmp(name, "atan", 4)) return func(token, FUNC_ATAN);
+                        return;
+                    case 'c':
+                        if (!memcmp(name, "ceil", 4)) return func(token, FUNC_CEIL);
+                        return;
+                    case 'r':
+                        if (!memcmp(name, "rand", 4)) return func(token, FUNC_RAND);
+                        return;
+                }
+                return;
+            case 5:
+                switch (name[0]) {
+                    case 'a':
+                        if (!memcmp(name, "atan2", 5)) return func(token, FUNC_ATAN2);
+                        if (!memcmp(name, "asinh", 5)) return func(token, FUNC_ASINH);
+                        if (!memcmp(name, "acosh", 5)) return func(token, FUNC_ACOSH);
+                        if (!memcmp(name, "atanh", 5)) return func(token, FUNC_ATANH);
+                        return;
+                    case 'f':
+                        if (!memcmp(name, "floor", 5)) return func(token, FUNC_FLOOR);
+                        if (!memcmp(name, "fract", 5)) return func(token, FUNC_FRACT);
+                        return;
+                    case 'h':
+                        if (!memcmp(name, "hypot", 5)) return func(token, FUNC_HYPOT);
+                        return;
+                    case 'r':
+                        if (!memcmp(name, "round", 5)) return func(token, FUNC_ROUND);
+                        return;
+                    case 't':
+                        if (!memcmp(name, "trunc", 5)) return func(token, FUNC_TRUNC);
+                        return;
+                }
+                return;
+            case 6:
+                if (!memcmp(name, "random", 6)) {
+                    return func(token, FUNC_RANDOM);
+                }
+                return;
+        }
+    }
+};
+
+template<size_t desired_capacity, typename Backend = ScalarBackend<> >
+class PixelFun {
+    typedef typename Backend::Math Math;
+    typedef typename Backend::Scalar::Value Value;
+
+    static_assert(PIXELFUN_BLOCK_SIZE % Backend::Vector::lanes == 0,
+                  "PIXELFUN_BLOCK_SIZE must be a multiple of the backend's vector width");
+    static_assert(desired_capacity < NO_EXPR, "Node indices are 16 bits wide");
+
+private:
+    // Nodes are handed out by a bump allocator and every node is allocated
+    // after its children, so the array holds the tree in evaluation order.
+    // Nodes dropped by fold() stay where they are until the next parse.
+    Expr nodes[desired_capacity];
+    ExprIndex nodeCount;
+    ExprIndex root;
+    // Nodes the parser allocated, before fold() and share() dropped any.
+    ExprIndex parsedCount;
+    // The compiled program consists of three segments. The frame segment
+    // computes everything that only depends on t and the row segment
+    // everything that only depends on t and y. Both store their results in
+    // slots, which the pixel segment then loads instead of recomputing them.
+    Instr<Value> code[desired_capacity + 2 * PIXELFUN_MAX_SLOTS];
+    size_t codeLength;
+    size_t rowStart;
+    size_t pixelStart;
+    size_t stackDepth;
+    ExprIndex hoisted[PIXELFUN_MAX_SLOTS];
+    size_t slotCount;
+    // Nodes used by more than one parent, one bit each. The first time the
+    // current segment evaluates one of them it keeps the value in a local,
+    // later uses in the same segment fetch it from there.
+    uint8_t shared[(desired_capacity + 7) / 8];
+    ExprIndex locals[PIXELFUN_MAX_LOCALS];
+    size_t localCount;
+    const char *parseError;
+    size_t parseErrorOffset;
+
+public:
+    // Memory taken by a node, by all nodes and by the compiled code. The
+    // whole instance is sizeof(PixelFun), a little more than the last two.
+    static constexpr size_t nodeBytes = sizeof(Expr);
+    static constexpr size_t treeBytes = sizeof(Expr) * desired_capacity;
+    static constexpr size_t codeBytes = sizeof(Instr<Value>) * (desired_capacity + 2 * PIXELFUN_MAX_SLOTS);
+
+    PixelFun() : nodes(), nodeCount(0), root(NO_EXPR), parsedCount(0), code(), codeLength(0), rowStart(0),
+                 pixelStart(0), stackDepth(0), hoisted(), slotCount(0), shared(), locals(), localCount(0),
+                 parseError(nullptr), parseErrorOffset(0) {}
+
+    std::tuple<uint8_t, uint8_t, uint8_t> interpolateColors(uint8_t a[3], uint8_t b[3], float t) {
+        t = fminf(fmaxf(t, -1.0f), 1.0f);
+        if (t > 0.0) {
+            return std::tuple<uint8_t, uint8_t, uint8_t>{(uint8_t) ((float) a[0] * t), (uint8_t) ((float) a[1] * t),
+                                                         (uint8_t) ((float) a[2] * t)};
+        } else if (t < 1.0) {
+            return std::tuple<uint8_t, uint8_t, uint8_t>{(uint8_t) ((float) b[0] * -t), (uint8_t) ((float) b[1] * -t),
+                                                         (uint8_t) ((float) b[2] * -t)};
+        } else {
+            return std::tuple<uint8_t, uint8_t, uint8_t>{0, 0, 0};
+        }
+    }
+
+    bool parse(const char *expr) {
+        if (root != NO_EXPR) {
+            dealloc();
+        }
+        parseError = nullptr;
+        parseErrorOffset = 0;
+        Expr *tree = parseProgram(expr);
+        if (tree) {
+            root = index(tree);
+            parsedCount = nodeCount;
+            fold(root);
+            compact();
+            tag();
+            share();
+            compact();
+            tag();
+            if (compile()) {
+                return true;
+            }
+        }
+        dealloc();
+        return false;
+    }
+
+    // Writes the parsed program into out in the binary format described at
+    // PROGRAM_FORMAT_VERSION and returns its size, or 0 if there is no program or
+    // it doesn't fit into capacity bytes.
+    size_t encode(uint8_t *out, size_t capacity) const {
+        if (root == NO_EXPR || capacity < PROGRAM_HEADER_SIZE) {
+            return 0;
+        }
+        size_t size = PROGRAM_HEADER_SIZE;
+        ExprIndex next = 0;
+        if (!encode(root, out, capacity, size, next)) {
+            return 0;
+        }
+        out[0] = 'P';
+        out[1] = 'F';
+        out[2] = PROGRAM_FORMAT_VERSION;
+        writeLE32(out + 3, programChecksum(out + PROGRAM_HEADER_SIZE, size - PROGRAM_HEADER_SIZE));
+        return size;
+    }
+
+    // Installs a program written by encode(). The records are only checked
+    // and compiled, nothing is parsed. Returns false like parse() if the
+    // program is invalid, with errorOffset() pointing at the offending byte.
+    bool decode(const uint8_t *data, size_t size) {
+        if (root != NO_EXPR) {
+            dealloc();
+        }
+        parseError = nullptr;
+        parseErrorOffset = 0;
+        if (decodeRecords(data, size)) {
+            parsedCount = nodeCount;
+            tag();
+            if (compile()) {
+                return true;
+            }
+        }
+        dealloc();
+        return false;
+    }
+
+    // Why the last parse() or decode() failed, or nullptr if it succeeded.
+    const char *error() const {
+        return parseError;
+    }
+
+    // Byte offset into the program of the token or record the last parse()
+    // or decode() failed at. Programs that are too large or too deep to
+    // compile fail at offset 0.
+    size_t errorOffset() const {
+        return parseErrorOffset;
+    }
+
+    // Number of nodes in the program. Constant folding and merging repeated
+    // subexpressions save parsedNodes() - programNodes() of them.
+    size_t programNodes() const {
+        return nodeCount;
+    }
+
+    // Number of nodes the parser produced, or decode() read.
+    size_t parsedNodes() const {
+        return parsedCount;
+    }
+
+    // Largest canvas, in pixels, that gets the right i with this backend.
+    // Larger ones render, but i stops growing.
+    static constexpr size_t maxPixels() {
+        return (size_t) Backend::Scalar::maxInt + 1;
+    }
+
+    // How the installed program can be rendered. A static program only needs
+    // to be rendered again when the canvas or the colors change. Frames of a
+    // uniform program are a single value, which evalFrame() and evalPoints()
+    // compute once and copy to every pixel.
+    RenderMode renderMode() const {
+        uint8_t deps = root == NO_EXPR ? 0 : nodes[root].deps;
+        if (deps & DEP_RAND) {
+            return RENDER_FULL;
+        }
+        if (!(deps & DEP_T)) {
+            return RENDER_STATIC;
+        }
+        return deps == DEP_T ? RENDER_UNIFORM : RENDER_FULL;
+    }
+
+    // Runs the compiled program. Every instruction pops its operands from and
+    // pushes its result onto a small value stack, so no recursion is needed.
+    float eval(float t, float i, float x, float y) {
+        typedef typename Backend::Scalar Ops;
+        Value slots[PIXELFUN_MAX_SLOTS];
+        Value is = Ops::fromFloat(i);
+        Value xs = Ops::fromFloat(x);
+        Value value;
+        run<Ops, 1>(code, code + codeLength, Ops::fromFloat(t), Ops::fromFloat(y), &is, &xs, slots, &value);
+        return Ops::toFloat(value);
+    }
+
+    // Evaluates the expression tree directly. Slower than eval(), but kept
+    // around as the reference the compiled program has to agree with.
+    float evalTree(float t, float i, float x, float y) {
+        return eval(at(root), t, i, x, y);
+    }
+
+    // Evaluates the program for every pixel of a width x height grid and
+    // writes the results row by row into out. Pixels are processed in blocks
+    // of PIXELFUN_BLOCK_SIZE, so each instruction is dispatched once per block
+    // instead of once per pixel.
+    void evalFrame(float t, size_t width, size_t height, float *out) {
+        evalTile(t, width, 0, 0, width, height, out);
+    }
+
+    // Like evalFrame(), but clamps every value to [-1, 1] and maps it to a
+    // byte, with 0 standing for -1 and 255 for 1. Backends without an FPU do
+    // this without any floating point math.
+    void evalFrame(float t, size_t width, size_t height, uint8_t *out) {
+        evalTile(t, width, 0, 0, width, height, out);
+    }
+
+    // Evaluates the program for count pixels anywhere on the canvas and
+    // writes the result for points[n] to out[n], as a float or a quantized
+    // byte like evalFrame(). Point needs x, y and i members, see
+    // LayoutPoint. Runs of pixels on the same row share the row segment and
+    // are evaluated in blocks, so points sorted by y and then x are as fast
+    // as a grid.
+    template<typename Point, typename T>
+    void evalPoints(float t, const Point *points, size_t count, T *out) const {
+        typedef typename Backend::Scalar Ops;
+        Value slots[PIXELFUN_MAX_SLOTS];
+        Value is[PIXELFUN_BLOCK_SIZE];
+        Value xs[PIXELFUN_BLOCK_SIZE];
+        Value values[PIXELFUN_BLOCK_SIZE];
+        Value frameTime = Ops::fromFloat(t);
+        Value row = 0;
+        if (uniform()) {
+            fill(frameTime, count, out);
+            return;
+        }
+        runSegment(0, rowStart, frameTime, 0, slots);
+        for (size_t n = 0; n < count;) {
+            if (n == 0 || points[n].y != points[n - 1].y) {
+                row = Ops::fromInt(points[n].y);
+                runSegment(rowStart, pixelStart, frameTime, row, slots);
+            }
+            size_t m = 0;
+            do {
+                is[m] = Ops::fromInt(points[n + m].i);
+                xs[m] = Ops::fromInt(points[n + m].x);
+                m++;
+            } while (m < PIXELFUN_BLOCK_SIZE && n + m < count && points[n + m].y == points[n].y);
+            // The rest of a partial block repeats its last pixel.
+            for (size_t k = m; k < PIXELFUN_BLOCK_SIZE; k++) {
+                is[k] = is[m - 1];
+                xs[k] = xs[m - 1];
+            }
+            evalBlock(frameTime, is, xs, row, slots, values);
+            for (size_t k = 0; k < m; k++) {
+                convert(values[k], out[n + k]);
+            }
+            n += m;
+        }
+    }
+
+    // Evaluates the width x height pixels of a tile whose top left corner is
+    // at left, top on a canvas canvasWidth pixels wide. They are written to
+    // out at the same place evalFrame() would write them for the whole
+    // canvas, as floats or quantized bytes.
+    //
+    // Only reads the program, so any number of threads can evaluate tiles
+    // of the same program at once as long as it isn't parsed or decoded
+    // meanwhile. rand() then draws from each thread's own generator, see
+    // Platform::random().
+    template<typename T>
+    void evalTile(float t, size_t canvasWidth, size_t left, size_t top, size_t width, size_t height, T *out) const {
+        typedef typename Backend::Scalar Ops;
+        Value slots[PIXELFUN_MAX_SLOTS];
+        Value is[PIXELFUN_BLOCK_SIZE];
+        Value xs[PIXELFUN_BLOCK_SIZE];
+        Value values[PIXELFUN_BLOCK_SIZE];
+        Value frameTime = Ops::fromFloat(t);
+        if (uniform()) {
+            fill(frameTime, width, out + top * canvasWidth + left);
+            for (size_t y = top + 1; y < top + height; y++) {
+                std::copy(out + top * canvasWidth + left, out + top * canvasWidth + left + width,
+                          out + y * canvasWidth + left);
+            }
+            return;
+        }
+        runSegment(0, rowStart, frameTime, 0, slots);
+        for (size_t y = top; y < top + height; y++) {
+            Value row = Ops::fromInt(y);
+            runSegment(rowStart, pixelStart, frameTime, row, slots);
+            for (size_t x = left; x < left + width; x += PIXELFUN_BLOCK_SIZE) {
+                size_t n = left + width - x < PIXELFUN_BLOCK_SIZE ? left + width - x : PIXELFUN_BLOCK_SIZE;
+                for (size_t k = 0; k < PIXELFUN_BLOCK_SIZE; k++) {
+                    is[k] = Ops::fromInt(y * canvasWidth + x + k);
+                    xs[k] = Ops::fromInt(x + k);
+                }
+                evalBlock(frameTime, is, xs, row, slots, values);
+                for (size_t k = 0; k < n; k++) {
+                    convert(values[k], out[y * canvasWidth + x + k]);
+                }
+            }
+        }
+    }
+
+    static uint8_t quantize(float value) {
+        return FloatOps<>::quantize(value);
+    }
+
+    void printAST() {
+        printAST(at(root), 0);
+    }
+
+private:
+    Expr *alloc(ExprType exprType) {
+        if (nodeCount == desired_capacity) {
+            Platform::println("Out of memory");
+            return nullptr;
+        }
+
+        Expr *expr = &nodes[nodeCount++];
+        expr->type = exprType;
+        expr->arity = 0;
+        return expr;
+    }
+
+    Expr *allocBinOp(BinOpType op, const Expr *a, const Expr *b) {
+        Expr *expr = alloc(EXPR_BINOP);
+        if (expr) {
+            expr->op = op;
+            expr->arity = 2;
+            expr->args[0] = index(a);
+            expr->args[1] = index(b);
+        }
+        return expr;
+    }
+
+    ExprIndex index(const Expr *expr) const {
+        return (ExprIndex) (expr - nodes);
+    }
+
+    Expr *at(ExprIndex index) {
+        return index == NO_EXPR ? nullptr : &nodes[index];
+    }
+
+    const Expr *at(ExprIndex index) const {
+        return index == NO_EXPR ? nullptr : &nodes[index];
+    }
+
+    void dealloc() {
+        nodeCount = 0;
+        root = NO_EXPR;
+        codeLength = 0;
+        rowStart = 0;
+        pixelStart = 0;
+        stackDepth = 0;
+        slotCount = 0;
+        localCount = 0;
+    }
+
+    // Merges structurally identical subtrees, so every distinct pure
+    // subexpression is a single node. Children precede their parents and are
+    // merged first, so two subtrees are identical exactly when their roots
+    // have the same contents, children included by index. rand() and
+    // random() give a new value on every call, so neither they nor anything
+    // using them is merged. Needs tag() to have marked those with DEP_RAND,
+    // and compact() to have dropped what fold() left behind: the kept node is
+    // the first of its kind, so the array stays in the order encode() needs.
+    //
+    // code serves as scratch again: node[0] holds the node each node was
+    // merged into, node[1] the buckets of a hash table of the nodes kept.
+    // compact() then drops the merged ones.
+    void share() {
+        // Twice as many buckets as nodes where code is large enough. It
+        // always has more entries than nodes, so probing finds a free one.
+        size_t buckets = 2 * (size_t) nodeCount;
+        if (buckets > sizeof(code) / sizeof(code[0])) {
+            buckets = sizeof(code) / sizeof(code[0]);
+        }
+        for (size_t b = 0; b < buckets; b++) {
+            code[b].node[1] = NO_EXPR;
+        }
+        for (size_t n = 0; n < nodeCount; n++) {
+            Expr &expr = nodes[n];
+            for (size_t i = 0; i < expr.arity; i++) {
+                expr.args[i] = code[expr.args[i]].node[0];
+            }
+            code[n].node[0] = (ExprIndex) n;
+            if (expr.deps & DEP_RAND) {
+                continue;
+            }
+            size_t b = hash(expr) % buckets;
+            while (code[b].node[1] != NO_EXPR && !same(nodes[code[b].node[1]], expr)) {
+                b = (b + 1) % buckets;
+            }
+            if (code[b].node[1] == NO_EXPR) {
+                code[b].node[1] = (ExprIndex) n;
+            } else {
+                code[n].node[0] = code[b].node[1];
+            }
+        }
+        root = code[root].node[0];
+    }
+
+    static uint32_t hash(const Expr &expr) {
+        uint32_t h = expr.type;
+        switch (expr.type) {
+            case EXPR_NUMBER: {
+                uint32_t bits;
+                memcpy(&bits, &expr.number, sizeof(bits));
+                h = h * 31 + bits;
+                break;
+            }
+            case EXPR_VAR:
+                h = h * 31 + expr.var;
+                break;
+            case EXPR_BINOP:
+                h = (h * 31 + expr.op) * 31 + expr.args[0];
+                h = h * 31 + expr.args[1];
+                break;
+            case EXPR_FUNC:
+                h = h * 31 + expr.func;
+                for (size_t i = 0; i < expr.arity; i++) {
+                    h = h * 31 + expr.args[i];
+                }
+                break;
+        }
+        return h * 2654435761u;
+    }
+
+    // Numbers compare by their bits, so 0 and -0 stay apart.
+    static bool same(const Expr &a, const Expr &b) {
+        if (a.type != b.type) {
+            return false;
+        }
+        switch (a.type) {
+            case EXPR_NUMBER:
+                return memcmp(&a.number, &b.number, sizeof(a.number)) == 0;
+            case EXPR_VAR:
+                return a.var == b.var;
+            case EXPR_BINOP:
+                return a.op == b.op && a.args[0] == b.args[0] && a.args[1] == b.args[1];
+            case EXPR_FUNC:
+                if (a.func != b.func || a.arity != b.arity) {
+                    return false;
+                }
+                for (size_t i = 0; i < a.arity; i++) {
+                    if (a.args[i] != b.args[i]) {
+                        return false;
+                    }
+                }
+                return true;
+        }
+        return false;
+    }
+
+    // Moves the nodes still reachable from root after folding to the front
+    // of the array, keeping their order. Where each node went is kept in
+    // code, which compile() overwrites afterwards anyway, and the marks in
+    // deps, which tag() recomputes.
+    void compact() {
+        for (size_t n = 0; n < nodeCount; n++) {
+            nodes[n].deps = 0;
+        }
+        nodes[root].deps = 1;
+        for (size_t n = nodeCount; n-- > 0;) {
+            for (size_t i = 0; nodes[n].deps && i < nodes[n].arity; i++) {
+                nodes[nodes[n].args[i]].deps = 1;
+            }
+        }
+
+        ExprIndex count = 0;
+        for (size_t n = 0; n < nodeCount; n++) {
+            if (!nodes[n].deps) {
+                continue;
+            }
+            Expr expr = nodes[n];
+            for (size_t i = 0; i < expr.arity; i++) {
+                expr.args[i] = code[expr.args[i]].node[0];
+            }
+            code[n].node[0] = count;
+            nodes[count++] = expr;
+        }
+        root = code[root].node[0];
+        nodeCount = count;
+    }
+
+    // Writes the records for the subtree at index. The parser allocates
+    // nodes in the order they are written here, which compact() preserves,
+    // so a node that was written already is the one behind an index below
+    // next.
+    bool encode(ExprIndex index, uint8_t *out, size_t capacity, size_t &size, ExprIndex &next) const {
+        if (index < next) {
+            if (capacity - size < 3) {
+                return false;
+            }
+            out[size] = RECORD_REF << 5;
+            writeLE16(out + size + 1, index);
+            size += 3;
+            return true;
+        }
+
+        const Expr &expr = nodes[index];
+        for (size_t i = 0; i < expr.arity; i++) {
+            if (!encode(expr.args[i], out, capacity, size, next)) {
+                return false;
+            }
+        }
+        if (index != next++ || capacity - size < 5) {
+            return false;
+        }
+
+        switch (expr.type) {
+            case EXPR_NUMBER: {
+                float scaled = expr.number * 256.0f;
+                if (expr.number >= 0 && expr.number <= 31 - NUMBER_SMALL && (float) (int) expr.number == expr.number &&
+                    !std::signbit(expr.number)) {
+                    out[size++] = RECORD_NUMBER << 5 | (NUMBER_SMALL + (int) expr.number);
+                } else if (scaled > -32768.0f && scaled < 32768.0f && (float) (int16_t) scaled == scaled &&
+                    !(expr.number == 0 && std::signbit(expr.number))) {
+                    out[size] = RECORD_NUMBER << 5 | NUMBER_FIXED;
+                    writeLE16(out + size + 1, (uint16_t) (int16_t) scaled);
+                    size += 3;
+                } else {
+                    uint32_t bits;
+                    memcpy(&bits, &expr.number, sizeof(bits));
+                    out[size] = RECORD_NUMBER << 5 | NUMBER_FLOAT;
+                    writeLE32(out + size + 1, bits);
+                    size += 5;
+                }
+                return true;
+            }
+            case EXPR_BINOP:
+                out[size++] = RECORD_BINOP << 5 | expr.op;
+                return true;
+            case EXPR_VAR:
+                out[size++] = RECORD_VAR << 5 | expr.var;
+                return true;
+            case EXPR_FUNC:
+                out[size++] = RECORD_FUNC << 5 | expr.func;
+                return true;
+        }
+        return false;
+    }
+
+    bool decodeRecords(const uint8_t *data, size_t size) {
+        if (size < PROGRAM_HEADER_SIZE || data[0] != 'P' || data[1] != 'F') {
+            return fail("Not a program", 0);
+        }
+        if (data[2] != PROGRAM_FORMAT_VERSION) {
+            return fail("Unsupported version", 2);
+        }
+        if (readLE32(data + 3) != programChecksum(data + PROGRAM_HEADER_SIZE, size - PROGRAM_HEADER_SIZE)) {
+            return fail("Checksum mismatch", 3);
+        }
+
+        // Indices of the values the next operator takes its operands from.
+        ExprIndex values[PIXELFUN_PARSE_DEPTH];
+        size_t valueCount = 0;
+        size_t offset = PROGRAM_HEADER_SIZE;
+        while (offset < size) {
+            uint8_t kind = data[offset] >> 5;
+            uint8_t sub = data[offset] & 31;
+            size_t length = 1;
+            if (kind == RECORD_REF || (kind == RECORD_NUMBER && sub == NUMBER_FIXED)) {
+                length = 3;
+            } else if (kind == RECORD_NUMBER && sub == NUMBER_FLOAT) {
+                length = 5;
+            }
+            if (size - offset < length) {
+                return fail("Truncated record", offset);
+            }
+
+            if (kind == RECORD_REF) {
+                ExprIndex index = readLE16(data + offset + 1);
+                if (index >= nodeCount) {
+                    return fail("Invalid reference", offset);
+                }
+                if (valueCount == PIXELFUN_PARSE_DEPTH) {
+                    return fail("Nested too deeply", offset);
+                }
+                values[valueCount++] = index;
+                offset += length;
+                continue;
+            }
+
+            if ((kind == RECORD_BINOP && sub > BINOP_BIT_XOR) ||
+                (kind == RECORD_VAR && sub > VAR_TAU) || (kind == RECORD_FUNC && sub > FUNC_HYPOT) ||
+                kind > RECORD_REF) {
+                return fail("Invalid record", offset);
+            }
+            uint8_t arity = kind == RECORD_BINOP ? 2 : kind == RECORD_FUNC ? funcArity((FuncType) sub) : 0;
+            if (valueCount < arity) {
+                return fail("Missing operand", offset);
+            }
+
+            Expr *expr = alloc((ExprType) kind);
+            if (!expr) {
+                return fail("Out of memory", offset);
+            }
+            switch (kind) {
+                case RECORD_NUMBER:
+                    if (sub >= NUMBER_SMALL) {
+                        expr->number = (float) (sub - NUMBER_SMALL);
+                    } else if (sub == NUMBER_FIXED) {
+                        expr->number = (float) (int16_t) readLE16(data + offset + 1) / 256.0f;
+                    } else {
+                        uint32_t bits = readLE32(data + offset + 1);
+                        memcpy(&expr->number, &bits, sizeof(bits));
+                    }
+                    if (!Backend::Scalar::inRange(expr->number)) {
+                        return fail("Number out of range", offset);
+                    }
+                    break;
+                case RECORD_BINOP:
+                    expr->op = (BinOpType) sub;
+                    break;
+                case RECORD_VAR:
+                    expr->var = (Var) sub;
+                    break;
+                case RECORD_FUNC:
+                    expr->func = (FuncType) sub;
+                    break;
+            }
+            expr->arity = arity;
+            valueCount -= arity;
+            for (size_t i = 0; i < arity; i++) {
+                expr->args[i] = values[valueCount + i];
+            }
+            if (valueCount == PIXELFUN_PARSE_DEPTH) {
+                return fail("Nested too deeply", offset);
+            }
+            values[valueCount++] = index(expr);
+            offset += length;
+        }
+
+        // The last record has to be the root, everything else its operands.
+        if (valueCount != 1 || values[0] != nodeCount - 1) {
+            return fail("Incomplete program", size);
+        }
+        root = values[0];
+        return true;
+    }
+
+    // Applies identities that do not change the result, once the parser has
+    // folded every constant operator and call, see foldConstant(). What is
+    // left to turn into numbers are pi and tau on their own. Folding only
+    // ever points a node at one of its descendants or turns it into a
+    // number, so children keep preceding their parents.
+    void fold(ExprIndex &index) {
+        Expr *expr = at(index);
+        if (!expr) {
+            return;
+        }
+
+        switch (expr->type) {
+            case EXPR_NUMBER:
+                return;
+            case EXPR_VAR:
+                if (expr->var == VAR_PI || expr->var == VAR_TAU) {
+                    expr->number = eval(expr, 0, 0, 0, 0);
+                    expr->type = EXPR_NUMBER;
+                }
+                return;
+            case EXPR_FUNC:
+                for (size_t i = 0; i < expr->arity; i++) {
+                    fold(expr->args[i]);
+                }
+                return;
+            case EXPR_BINOP:
+                break;
+        }
+
+        fold(expr->args[0]);
+        fold(expr->args[1]);
+        const Expr *a = at(expr->args[0]);
+        const Expr *b = at(expr->args[1]);
+
+        switch (expr->op) {
+            case BINOP_ADD:
+                // -0 + 0 is 0, so only adding -0 leaves every x as it is.
+                if (isZero(b, true)) {
+                    index = expr->args[0];
+                } else if (isZero(a, true)) {
+                    index = expr->args[1];
+                }
+                break;
+            case BINOP_SUB:
+                if (isZero(b, false)) {
+                    index = expr->args[0];
+                }
+                break;
+            case BINOP_MUL:
+                if (isNumber(b, 1)) {
+                    index = expr->args[0];
+                } else if (isNumber(a, 1)) {
+                    index = expr->args[1];
+                }
+                break;
+            case BINOP_DIV:
+            case BINOP_POW:
+                if (isNumber(b, 1)) {
+                    index = expr->args[0];
+                } else if (expr->op == BINOP_POW && isNumber(b, 2) && isPure(a)) {
+                    // Both operands share the node, the compiled program
+                    // evaluates it once and duplicates the result.
+                    expr->op = BINOP_MUL;
+                    expr->args[1] = expr->args[0];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Replaces an operator or call the parser just built with its value if
+    // all of its operands are constant, so constants are checked against
+    // the backend right where they come from. Returns false if the backend
+    // can't represent the value. Constants are computed with the tree
+    // interpreter, so folding follows the exact same rules as evaluation.
+    bool foldConstant(Expr *expr) {
+        if (expr->type == EXPR_FUNC && (expr->func == FUNC_RAND || expr->func == FUNC_RANDOM)) {
+            return true;
+        }
+        for (size_t i = 0; i < expr->arity; i++) {
+            const Expr *arg = at(expr->args[i]);
+            if (arg->type != EXPR_NUMBER && !(arg->type == EXPR_VAR && (arg->var == VAR_PI || arg->var == VAR_TAU))) {
+                return true;
+            }
+        }
+        float value = eval(expr, 0, 0, 0, 0);
+        if (!Backend::Scalar::inRange(value)) {
+            return false;
+        }
+        expr->type = EXPR_NUMBER;
+        expr->arity = 0;
+        expr->number = value;
+        return true;
     }
 
-    void printAST() {
-        printAST(root, 0);
+    static bool isNumber(const Expr *expr, float value) {
+        return expr->type == EXPR_NUMBER && expr->number == value;
     }
 
-private:
-    Expr *alloc(ExprType exprType) {
-        if (stackTop == 0) {
-            Serial.println("Out of memory");
-            return nullptr;
-        }
-
-        size_t idx = freeIndices[--stackTop];
-        pool[idx].type = exprType;
-        return &pool[idx];
+    static bool isZero(const Expr *expr, bool negative) {
+        return isNumber(expr, 0) && (bool) std::signbit(expr->number) == negative;
     }
 
-    void dealloc() {
-        for (size_t i = 0; i < desired_capacity; i++) {
-            freeIndices[i] = i;
+    bool isPure(const Expr *expr) const {
+        if (expr->type == EXPR_FUNC && (expr->func == FUNC_RAND || expr->func == FUNC_RANDOM)) {
+            return false;
         }
-        stackTop = desired_capacity;
-        root = nullptr;
-    }
-
-    void dealloc(const Expr *expr) {
-        if (!expr) {
-            return;
+        for (size_t i = 0; i < expr->arity; i++) {
+            if (!isPure(at(expr->args[i]))) {
+                return false;
+            }
         }
-        size_t idx = expr - pool;
-        freeIndices[stackTop++] = idx;
+        return true;
     }
 
-    float eval(Expr *expr, float t, float i, float x, float y) {
+    float eval(const Expr *expr, float t, float i, float x, float y) const {
         if (!expr) {
             return 0;
         }
@@ -178,60 +2243,60 @@ private:
                     case VAR_Y:
                         return y;
                     case VAR_PI:
-                        return PI;
+                        return PIXELFUN_PI;
                     case VAR_TAU:
-                        return 2 * PI;
+                        return 2 * PIXELFUN_PI;
                 }
             case EXPR_FUNC:
-                switch (expr->funcCall.func) {
+                switch (expr->func) {
                     case FUNC_RAND:
                     case FUNC_RANDOM:
-                        return (float) random(RAND_MAX) / (float) RAND_MAX;
+                        return (float) Platform::random(RAND_MAX) / (float) RAND_MAX;
                     case FUNC_SIN:
-                        return sinf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::sin(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_COS:
-                        return cosf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::cos(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_TAN:
-                        return tanf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::tan(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ASIN:
-                        return asinf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::asin(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ACOS:
-                        return acosf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::acos(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ATAN:
-                        return atanf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::atan(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ATAN2:
-                        return atan2f(eval(expr->funcCall.args[0], t, i, x, y),
-                                      eval(expr->funcCall.args[1], t, i, x, y));
+                        return Math::atan2(eval(at(expr->args[0]), t, i, x, y),
+                                           eval(at(expr->args[1]), t, i, x, y));
                     case FUNC_ASINH:
-                        return asinhf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::asinh(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ACOSH:
-                        return acoshf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::acosh(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ATANH:
-                        return atanhf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return Math::atanh(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_FLOOR:
-                        return floorf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return floorf(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_CEIL:
-                        return ceilf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return ceilf(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_ROUND:
-                        return roundf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return roundf(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_FRACT: {
-                        auto arg = eval(expr->funcCall.args[0], t, i, x, y);
+                        auto arg = eval(at(expr->args[0]), t, i, x, y);
                         return arg - truncf(arg);
                     }
                     case FUNC_TRUNC:
-                        return truncf(eval(expr->funcCall.args[0], t, i, x, y));
+                        return truncf(eval(at(expr->args[0]), t, i, x, y));
                     case FUNC_HYPOT:
-                        return sqrt(pow(eval(expr->funcCall.args[0], t, i, x, y), 2.0f) +
-                                    pow(eval(expr->funcCall.args[1], t, i, x, y), 2.0f));
+                        return Math::hypot(eval(at(expr->args[0]), t, i, x, y),
+                                           eval(at(expr->args[1]), t, i, x, y));
                 }
             case EXPR_BINOP:
-                float lhs = eval(expr->binop.a, t, i, x, y);
-                float rhs = eval(expr->binop.b, t, i, x, y);
-                switch (expr->binop.op) {
+                float lhs = eval(at(expr->args[0]), t, i, x, y);
+                float rhs = eval(at(expr->args[1]), t, i, x, y);
+                switch (expr->op) {
                     case BINOP_POW:
-                        return pow(lhs, rhs);
+                        return Math::pow(lhs, rhs);
                     case BINOP_MOD:
-                        return fmod(lhs, rhs);
+                        return Math::mod(lhs, rhs);
                     case BINOP_ADD:
                         return lhs + rhs;
                     case BINOP_SUB:
@@ -275,647 +2340,924 @@ private:
         return 0;
     }
 
-    const char *parseExpr(const char *input, Expr *&node) {
-        input = parseLogical(input, node);
-        if (!input) {
-            return nullptr;
-        }
-
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const auto nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_ADD && op != BINOP_SUB)) {
-                break;
-            }
-
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            Expr *rhs = nullptr;
-            input = parseLogical(input, rhs);
-            if (!input) {
-                return nullptr;
+    // Runs the instructions in [begin, end) for N vectors of Ops::lanes pixels
+    // each. Every stack entry and local holds one value per pixel, t, y and
+    // the slots are shared by all of them. If out is given, it receives the
+    // value left on top of the stack.
+    template<typename Ops, size_t N>
+    static void run(const Instr<Value> *begin, const Instr<Value> *end, Value t, Value y, const typename Ops::Vec *is,
+                    const typename Ops::Vec *xs, Value *slots, typename Ops::Vec *out) {
+        typedef typename Ops::Vec Vec;
+        Vec stack[PIXELFUN_STACK_SIZE][N];
+        Vec locals[PIXELFUN_MAX_LOCALS][N];
+        Vec (*sp)[N] = stack;
+        for (const Instr<Value> *ip = begin; ip != end; ip++) {
+            switch (ip->op) {
+                case OP_NUMBER:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = Ops::splat(ip->number);
+                    }
+                    sp++;
+                    break;
+                case OP_T:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = Ops::splat(t);
+                    }
+                    sp++;
+                    break;
+                case OP_I:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = is[k];
+                    }
+                    sp++;
+                    break;
+                case OP_X:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = xs[k];
+                    }
+                    sp++;
+                    break;
+                case OP_Y:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = Ops::splat(y);
+                    }
+                    sp++;
+                    break;
+                case OP_POW:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::pow(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_MOD:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::mod(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_ADD:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::add(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_SUB:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::sub(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_MUL:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::mul(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_DIV:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::div(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_LSHIFT:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::lshift(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_RSHIFT:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::rshift(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_LTE:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::lte(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_GTE:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::gte(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_LT:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::lt(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_GT:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::gt(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_EQ:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::eq(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_NEQ:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::neq(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_OR:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::logicalOr(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_BIT_OR:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::bitOr(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_AND:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::logicalAnd(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_BIT_AND:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::bitAnd(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_BIT_XOR:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::bitXor(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_RAND:
+                case OP_RANDOM:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = Ops::random();
+                    }
+                    sp++;
+                    break;
+                case OP_SIN:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::sin(sp[-1][k]);
+                    }
+                    break;
+                case OP_COS:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::cos(sp[-1][k]);
+                    }
+                    break;
+                case OP_TAN:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::tan(sp[-1][k]);
+                    }
+                    break;
+                case OP_ASIN:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::asin(sp[-1][k]);
+                    }
+                    break;
+                case OP_ACOS:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::acos(sp[-1][k]);
+                    }
+                    break;
+                case OP_ATAN:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::atan(sp[-1][k]);
+                    }
+                    break;
+                case OP_ATAN2:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::atan2(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_ASINH:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::asinh(sp[-1][k]);
+                    }
+                    break;
+                case OP_ACOSH:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::acosh(sp[-1][k]);
+                    }
+                    break;
+                case OP_ATANH:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::atanh(sp[-1][k]);
+                    }
+                    break;
+                case OP_FLOOR:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::floor(sp[-1][k]);
+                    }
+                    break;
+                case OP_CEIL:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::ceil(sp[-1][k]);
+                    }
+                    break;
+                case OP_ROUND:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::round(sp[-1][k]);
+                    }
+                    break;
+                case OP_FRACT:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::fract(sp[-1][k]);
+                    }
+                    break;
+                case OP_TRUNC:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::trunc(sp[-1][k]);
+                    }
+                    break;
+                case OP_HYPOT:
+                    sp--;
+                    for (size_t k = 0; k < N; k++) {
+                        sp[-1][k] = Ops::hypot(sp[-1][k], sp[0][k]);
+                    }
+                    break;
+                case OP_DUP:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = sp[-1][k];
+                    }
+                    sp++;
+                    break;
+                case OP_LOAD:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = Ops::splat(slots[ip->slot]);
+                    }
+                    sp++;
+                    break;
+                case OP_STORE:
+                    sp--;
+                    slots[ip->slot] = Ops::extract(sp[0][0]);
+                    break;
+                case OP_TEE:
+                    for (size_t k = 0; k < N; k++) {
+                        locals[ip->slot][k] = sp[-1][k];
+                    }
+                    break;
+                case OP_LOCAL:
+                    for (size_t k = 0; k < N; k++) {
+                        sp[0][k] = locals[ip->slot][k];
+                    }
+                    sp++;
+                    break;
             }
+        }
 
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
+        if (out) {
+            for (size_t k = 0; k < N; k++) {
+                out[k] = sp == stack ? Ops::splat(0) : sp[-1][k];
             }
-
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
         }
+    }
 
-        return input;
+    void runSegment(size_t begin, size_t end, Value t, Value y, Value *slots) const {
+        run<typename Backend::Scalar, 1>(code + begin, code + end, t, y, nullptr, nullptr, slots, nullptr);
     }
 
-    const char *parseNumber(const char *exprStr, Expr *&expr) {
-        char *end;
-        float value = strtof(exprStr, &end);
-        if (end == exprStr) {
-            return nullptr;
-        }
+    // Whether every pixel of a frame has the same value.
+    bool uniform() const {
+        return root != NO_EXPR && (nodes[root].deps & (DEP_I | DEP_X | DEP_Y | DEP_RAND)) == 0;
+    }
 
-        expr = alloc(EXPR_NUMBER);
-        if (!expr) {
-            return nullptr;
+    // Evaluates a uniform program once and writes the value count times.
+    template<typename T>
+    void fill(Value t, size_t count, T *out) const {
+        Value slots[PIXELFUN_MAX_SLOTS];
+        Value zero = 0;
+        Value value;
+        run<typename Backend::Scalar, 1>(code, code + codeLength, t, zero, &zero, &zero, slots, &value);
+        T converted;
+        convert(value, converted);
+        for (size_t n = 0; n < count; n++) {
+            out[n] = converted;
         }
+    }
 
-        expr->number = value;
-        return end;
-    };
+    static void convert(Value value, float &out) {
+        out = Backend::Scalar::toFloat(value);
+    }
 
-    const char *parseBinOp(const char *input, BinOpType &op) {
-        static const struct {
-            const char *opStr;
-            BinOpType opType;
-        } ops[] = {
-                {"**", BINOP_POW},
-                {"%",  BINOP_MOD},
-                {"+",  BINOP_ADD},
-                {"-",  BINOP_SUB},
-                {"*",  BINOP_MUL},
-                {"/",  BINOP_DIV},
-                {"<<", BINOP_LSHIFT},
-                {">>", BINOP_RSHIFT},
-                {"<=", BINOP_LTE},
-                {">=", BINOP_GTE},
-                {"<",  BINOP_LT},
-                {">",  BINOP_GT},
-                {"==", BINOP_EQ},
-                {"!=", BINOP_NEQ},
-                {"||", BINOP_OR},
-                {"|",  BINOP_BIT_OR},
-                {"&&", BINOP_AND},
-                {"&",  BINOP_BIT_AND},
-                {"^",  BINOP_BIT_XOR},
-        };
-        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
-            size_t len = strlen(ops[i].opStr);
-            if (strncmp(input, ops[i].opStr, len) == 0) {
-                op = ops[i].opType;
-                return input + len;
-            }
-        }
-        return nullptr;
+    static void convert(Value value, uint8_t &out) {
+        out = Backend::Scalar::quantize(value);
     }
 
-    const char *parseTerm(const char *input, Expr *&node) {
-        input = parsePower(input, node);
-        if (!input) {
-            return nullptr;
+    // Runs the pixel segment for PIXELFUN_BLOCK_SIZE pixels on row y, the
+    // k-th of them at x = x[k] with index i[k].
+    void evalBlock(Value t, const Value *i, const Value *x, Value y, Value *slots, Value *out) const {
+        typedef typename Backend::Vector Ops;
+        const size_t vectors = PIXELFUN_BLOCK_SIZE / Ops::lanes;
+
+        typename Ops::Vec is[vectors];
+        typename Ops::Vec xs[vectors];
+        typename Ops::Vec values[vectors];
+        for (size_t v = 0; v < vectors; v++) {
+            is[v] = Ops::load(i + v * Ops::lanes);
+            xs[v] = Ops::load(x + v * Ops::lanes);
         }
 
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_MUL && op != BINOP_DIV && op != BINOP_MOD)) {
-                break;
-            }
-
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            Expr *rhs = nullptr;
-            input = parsePower(input, rhs);
-            if (!input) {
-                return nullptr;
-            }
-
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
-            }
+        run<Ops, vectors>(code + pixelStart, code + codeLength, t, y, is, xs, slots, values);
 
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
+        for (size_t v = 0; v < vectors; v++) {
+            Ops::store(values[v], out + v * Ops::lanes);
         }
-        return input;
     }
 
-    const char *parsePower(const char *input, Expr *&node) {
-        input = parsePrimary(input, node);
-        if (!input) {
-            return nullptr;
-        }
-
-        while (true) {
-            const char *nextInput = strncmp(input, "**", 2) == 0 ? input + 2 : nullptr;
-            if (!nextInput) {
-                break;
-            }
-
-            while (*nextInput && isspace(*nextInput)) {
-                nextInput++;
-            }
-
-            Expr *rhs = nullptr;
-            nextInput = parsePrimary(nextInput, rhs);
-            if (!nextInput) {
-                return nullptr;
+    // Works out what every node depends on. Children always precede their
+    // parents, so a single pass over the node array sees them first.
+    void tag() {
+        for (size_t n = 0; n < nodeCount; n++) {
+            Expr &expr = nodes[n];
+            switch (expr.type) {
+                case EXPR_NUMBER:
+                    expr.deps = 0;
+                    continue;
+                case EXPR_VAR:
+                    expr.deps = expr.var == VAR_PI || expr.var == VAR_TAU ? 0 : 1 << expr.var;
+                    continue;
+                case EXPR_FUNC:
+                    expr.deps = expr.func == FUNC_RAND || expr.func == FUNC_RANDOM ? DEP_RAND : 0;
+                    break;
+                case EXPR_BINOP:
+                    expr.deps = 0;
+                    break;
             }
-
-            Expr *powOp = alloc(EXPR_BINOP);
-            if (!powOp) {
-                return nullptr;
+            for (size_t i = 0; i < expr.arity; i++) {
+                expr.deps |= nodes[expr.args[i]].deps;
             }
-
-            powOp->binop.op = BINOP_POW;
-            powOp->binop.a = node;
-            powOp->binop.b = rhs;
-            node = powOp;
-            input = nextInput;
         }
-
-        return input;
     }
 
-    const char *parseShift(const char *input, Expr *&node) {
-        input = parseTerm(input, node);
-        if (!input) {
-            return nullptr;
+    bool compile() {
+        codeLength = 0;
+        stackDepth = 0;
+        slotCount = 0;
+        localCount = 0;
+        markShared();
+        const Expr *tree = at(root);
+        if (!tree || !hoist(tree, DEP_T)) {
+            return false;
         }
+        rowStart = codeLength;
+        localCount = 0;
+        if (!hoist(tree, DEP_T | DEP_Y)) {
+            return false;
+        }
+        pixelStart = codeLength;
+        localCount = 0;
+        size_t depth = 0;
+        return compile(tree, depth);
+    }
 
-        while (true) {
-            if (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_LSHIFT && op != BINOP_RSHIFT)) {
-                break;
-            }
-
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            Expr *rhs = nullptr;
-            input = parseTerm(input, rhs);
-            if (!input) {
-                return nullptr;
-            }
-
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
+    // Sets the bit in shared of every node with more than one parent. An
+    // operator applied to the same node twice counts once, see OP_DUP.
+    void markShared() {
+        uint8_t seen[sizeof(shared)] = {};
+        memset(shared, 0, sizeof(shared));
+        for (size_t n = 0; n < nodeCount; n++) {
+            const Expr &expr = nodes[n];
+            for (size_t i = 0; i < expr.arity; i++) {
+                ExprIndex child = expr.args[i];
+                if (i > 0 && child == expr.args[0]) {
+                    continue;
+                }
+                if (seen[child / 8] & (1 << child % 8)) {
+                    shared[child / 8] |= 1 << child % 8;
+                }
+                seen[child / 8] |= 1 << child % 8;
             }
-
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
         }
-
-        return input;
     }
 
-    const char *parseComparison(const char *input, Expr *&node) {
-        input = parseShift(input, node);
-        if (!input) {
-            return nullptr;
+    // Emits the largest subtrees that only depend on the inputs in mask into
+    // the current segment and assigns each of them a slot. Leaves are cheaper
+    // to evaluate than to load, so they are never hoisted.
+    bool hoist(const Expr *expr, uint8_t mask) {
+        if (slot(expr) < slotCount || expr->type == EXPR_NUMBER || expr->type == EXPR_VAR) {
+            return true;
         }
 
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_LTE && op != BINOP_GTE && op != BINOP_LT && op != BINOP_GT)) {
-                break;
+        if ((expr->deps & ~mask) == 0 && slotCount < PIXELFUN_MAX_SLOTS) {
+            size_t depth = 0;
+            if (!compile(expr, depth) || !emit(OP_STORE, 0, depth, -1)) {
+                return false;
             }
+            code[codeLength - 1].slot = slotCount;
+            hoisted[slotCount++] = index(expr);
+            return true;
+        }
 
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
+        for (size_t i = 0; i < expr->arity; i++) {
+            if (!hoist(at(expr->args[i]), mask)) {
+                return false;
             }
+        }
+        return true;
+    }
 
-            Expr *rhs = nullptr;
-            input = parseShift(input, rhs);
-            if (!input) {
-                return nullptr;
+    size_t slot(const Expr *expr) const {
+        for (size_t i = 0; i < slotCount; i++) {
+            if (hoisted[i] == index(expr)) {
+                return i;
             }
+        }
+        return slotCount;
+    }
 
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
+    size_t local(const Expr *expr) const {
+        for (size_t i = 0; i < localCount; i++) {
+            if (locals[i] == index(expr)) {
+                return i;
             }
-
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
         }
-        return input;
+        return localCount;
     }
 
-    const char *parseEquality(const char *input, Expr *&node) {
-        input = parseComparison(input, node);
-        if (!input) {
-            return nullptr;
+    bool compile(const Expr *expr, size_t &depth) {
+        if (!expr) {
+            return false;
         }
 
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_EQ && op != BINOP_NEQ)) {
-                break;
-            }
-
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
+        size_t exprSlot = slot(expr);
+        if (exprSlot < slotCount) {
+            if (!emit(OP_LOAD, 0, depth, 1)) {
+                return false;
             }
+            code[codeLength - 1].slot = exprSlot;
+            return true;
+        }
 
-            Expr *rhs = nullptr;
-            input = parseComparison(input, rhs);
-            if (!input) {
-                return nullptr;
+        size_t exprLocal = local(expr);
+        if (exprLocal < localCount) {
+            if (!emit(OP_LOCAL, 0, depth, 1)) {
+                return false;
             }
+            code[codeLength - 1].slot = exprLocal;
+            return true;
+        }
 
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
+        if (!compileNode(expr, depth)) {
+            return false;
+        }
+        // Leaves are as cheap to evaluate again as to fetch. Once all locals
+        // are taken, further shared nodes are evaluated at every use.
+        ExprIndex n = index(expr);
+        if (expr->arity > 0 && (shared[n / 8] & (1 << n % 8)) && localCount < PIXELFUN_MAX_LOCALS) {
+            if (!emit(OP_TEE, 0, depth, 0)) {
+                return false;
             }
-
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
+            code[codeLength - 1].slot = localCount;
+            locals[localCount++] = n;
         }
-        return input;
+        return true;
     }
 
-    const char *parseBitwise(const char *input, Expr *&node) {
-        input = parseEquality(input, node);
-        if (!input) {
-            return nullptr;
+    bool compileNode(const Expr *expr, size_t &depth) {
+        switch (expr->type) {
+            case EXPR_NUMBER:
+                return emit(OP_NUMBER, expr->number, depth, 1);
+            case EXPR_VAR:
+                switch (expr->var) {
+                    case VAR_T:
+                        return emit(OP_T, 0, depth, 1);
+                    case VAR_I:
+                        return emit(OP_I, 0, depth, 1);
+                    case VAR_X:
+                        return emit(OP_X, 0, depth, 1);
+                    case VAR_Y:
+                        return emit(OP_Y, 0, depth, 1);
+                    case VAR_PI:
+                        return emit(OP_NUMBER, PIXELFUN_PI, depth, 1);
+                    case VAR_TAU:
+                        return emit(OP_NUMBER, 2 * PIXELFUN_PI, depth, 1);
+                }
+                return false;
+            case EXPR_FUNC:
+                for (size_t i = 0; i < expr->arity; i++) {
+                    if (!compile(at(expr->args[i]), depth)) {
+                        return false;
+                    }
+                }
+                return emit((OpCode) (OP_RAND + expr->func), 0, depth, 1 - (int) expr->arity);
+            case EXPR_BINOP:
+                if (expr->args[0] == expr->args[1]) {
+                    if (!compile(at(expr->args[0]), depth) || !emit(OP_DUP, 0, depth, 1)) {
+                        return false;
+                    }
+                } else if (!compile(at(expr->args[0]), depth) || !compile(at(expr->args[1]), depth)) {
+                    return false;
+                }
+                return emit((OpCode) (OP_POW + expr->op), 0, depth, -1);
         }
 
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_BIT_OR && op != BINOP_BIT_AND && op != BINOP_BIT_XOR)) {
-                break;
-            }
-
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
-            }
-
-            Expr *rhs = nullptr;
-            input = parseEquality(input, rhs);
-            if (!input) {
-                return nullptr;
-            }
-
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
-            }
+        return false;
+    }
 
-            binOp->binop.op = op;
-            binOp->binop.a = node;
-            binOp->binop.b = rhs;
-            node = binOp;
+    bool emit(OpCode op, float number, size_t &depth, int stackEffect) {
+        if (codeLength == sizeof(code) / sizeof(code[0])) {
+            Platform::println("Program too large");
+            parseError = "Program too large";
+            return false;
+        }
+        depth += stackEffect;
+        if (depth > PIXELFUN_STACK_SIZE) {
+            Platform::println("Program too deep");
+            parseError = "Program too deep";
+            return false;
         }
-        return input;
+        if (depth > stackDepth) {
+            stackDepth = depth;
+        }
+
+        code[codeLength].op = op;
+        code[codeLength].number = Backend::Scalar::fromFloat(number);
+        codeLength++;
+        return true;
     }
 
-    const char *parseLogical(const char *input, Expr *&expr) {
-        input = parseBitwise(input, expr);
-        if (!input) {
-            return nullptr;
+    // Binding strength of each operator, higher binds tighter. All operators
+    // are left associative.
+    static uint8_t precedence(BinOpType op) {
+        switch (op) {
+            case BINOP_ADD:
+            case BINOP_SUB:
+                return 1;
+            case BINOP_OR:
+            case BINOP_AND:
+                return 2;
+            case BINOP_BIT_OR:
+            case BINOP_BIT_AND:
+            case BINOP_BIT_XOR:
+                return 3;
+            case BINOP_EQ:
+            case BINOP_NEQ:
+                return 4;
+            case BINOP_LTE:
+            case BINOP_GTE:
+            case BINOP_LT:
+            case BINOP_GT:
+                return 5;
+            case BINOP_LSHIFT:
+            case BINOP_RSHIFT:
+                return 6;
+            case BINOP_MUL:
+            case BINOP_DIV:
+            case BINOP_MOD:
+                return 7;
+            case BINOP_POW:
+                return 8;
         }
+        return 0;
+    }
 
-        while (true) {
-            while (*input && isspace(*input)) {
-                input++;
-            }
+    // An operator, parenthesis or function call still waiting for its
+    // operands while parsing.
+    struct Pending {
+        enum Kind : uint8_t { BINOP, GROUP, CALL } kind;
+        // The BinOpType or FuncType.
+        uint8_t op;
+        // Arguments a call takes and has seen so far.
+        uint8_t arity;
+        uint8_t args;
+        // Where the operator or the name of the function is in the source.
+        size_t offset;
+    };
 
-            BinOpType op;
-            const char *nextInput = parseBinOp(input, op);
-            if (!nextInput || (op != BINOP_OR && op != BINOP_AND)) {
-                break;
-            }
+    // Parses by precedence climbing, but without recursion: values and
+    // pending operators live on two stacks of PIXELFUN_PARSE_DEPTH entries,
+    // so nesting can't overflow the task's stack and every token is handled
+    // in constant time. Operators are reduced as soon as one that binds less
+    // tightly follows, which allocates every node after its children.
+    Expr *parseProgram(const char *source) {
+        Lexer lexer(source);
+        Expr *values[PIXELFUN_PARSE_DEPTH];
+        Pending pending[PIXELFUN_PARSE_DEPTH];
+        size_t valueCount = 0;
+        size_t pendingCount = 0;
+        bool value = true;
 
-            input = nextInput;
-            while (*input && isspace(*input)) {
-                input++;
+        while (true) {
+            Token token = lexer.next(value);
+
+            if (value) {
+                Expr *node = nullptr;
+                switch (token.type) {
+                    case TOKEN_NUMBER:
+                        if (!Backend::Scalar::inRange(token.number)) {
+                            return fail("Number out of range", token);
+                        }
+                        if (!(node = alloc(EXPR_NUMBER))) {
+                            return fail("Out of memory", token);
+                        }
+                        node->number = token.number;
+                        break;
+                    case TOKEN_VAR:
+                        if (!(node = alloc(EXPR_VAR))) {
+                            return fail("Out of memory", token);
+                        }
+                        node->var = token.var;
+                        break;
+                    case TOKEN_FUNC: {
+                        Token open = lexer.next(true);
+                        if (open.type != TOKEN_OPEN) {
+                            return fail("Expected '('", open);
+                        }
+                        if (token.arity > 0) {
+                            if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                                return fail("Nested too deeply", token);
+                            }
+                            pending[pendingCount++] = {Pending::CALL, token.func, token.arity, 0, token.offset};
+                            continue;
+                        }
+                        Token close = lexer.next(false);
+                        if (close.type != TOKEN_CLOSE) {
+                            return fail("Expected ')'", close);
+                        }
+                        if (!(node = alloc(EXPR_FUNC))) {
+                            return fail("Out of memory", token);
+                        }
+                        node->func = token.func;
+                        break;
+                    }
+                    case TOKEN_OPEN:
+                        if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                            return fail("Nested too deeply", token);
+                        }
+                        pending[pendingCount++] = {Pending::GROUP, 0, 0, 0, token.offset};
+                        continue;
+                    case TOKEN_INVALID:
+                        return fail(invalid(source, token), token);
+                    default:
+                        return fail("Expected a value", token);
+                }
+                if (valueCount == PIXELFUN_PARSE_DEPTH) {
+                    return fail("Nested too deeply", token);
+                }
+                values[valueCount++] = node;
+                value = false;
+                continue;
             }
 
-            Expr *rhs = nullptr;
-            input = parseBitwise(input, rhs);
-            if (!input) {
-                return nullptr;
+            // Everything but another operator ends the operators pending
+            // since the innermost parenthesis or call.
+            uint8_t binding = token.type == TOKEN_BINOP ? precedence(token.op) : 0;
+            while (pendingCount && pending[pendingCount - 1].kind == Pending::BINOP &&
+                   precedence((BinOpType) pending[pendingCount - 1].op) >= binding) {
+                Expr *rhs = values[--valueCount];
+                Expr *lhs = values[valueCount - 1];
+                const Pending &op = pending[--pendingCount];
+                if (!(values[valueCount - 1] = allocBinOp((BinOpType) op.op, lhs, rhs))) {
+                    return fail("Out of memory", token);
+                }
+                if (!foldConstant(values[valueCount - 1])) {
+                    fail("Number out of range", op.offset);
+                    return nullptr;
+                }
             }
 
-            Expr *binOp = alloc(EXPR_BINOP);
-            if (!binOp) {
-                return nullptr;
+            Pending *top = pendingCount ? &pending[pendingCount - 1] : nullptr;
+            switch (token.type) {
+                case TOKEN_BINOP:
+                    if (pendingCount == PIXELFUN_PARSE_DEPTH) {
+                        return fail("Nested too deeply", token);
+                    }
+                    pending[pendingCount++] = {Pending::BINOP, token.op, 0, 0, token.offset};
+                    value = true;
+                    break;
+                case TOKEN_COMMA:
+                    if (!top || top->kind != Pending::CALL || top->args + 1 == top->arity) {
+                        return fail("Unexpected ','", token);
+                    }
+                    top->args++;
+                    value = true;
+                    break;
+                case TOKEN_CLOSE:
+                    if (!top) {
+                        return fail("Unexpected ')'", token);
+                    }
+                    if (top->kind == Pending::CALL) {
+                        if (top->args + 1 != top->arity) {
+                            return fail("Expected ','", token);
+                        }
+                        // The arguments were parsed first, so they end up in
+                        // front of the call in the node array.
+                        Expr *call = alloc(EXPR_FUNC);
+                        if (!call) {
+                            return fail("Out of memory", token);
+                        }
+                        call->func = (FuncType) top->op;
+                        call->arity = top->arity;
+                        valueCount -= top->arity;
+                        for (size_t arg = 0; arg < top->arity; arg++) {
+                            call->args[arg] = index(values[valueCount + arg]);
+                        }
+                        if (!foldConstant(call)) {
+                            fail("Number out of range", top->offset);
+                            return nullptr;
+                        }
+                        values[valueCount++] = call;
+                    }
+                    pendingCount--;
+                    break;
+                case TOKEN_END:
+                    if (top) {
+                        return fail("Expected ')'", token);
+                    }
+                    return values[0];
+                case TOKEN_INVALID:
+                    return fail(invalid(source, token), token);
+                default:
+                    return fail("Expected an operator", token);
             }
-
-            binOp->binop.op = op;
-            binOp->binop.a = expr;
-            binOp->binop.b = rhs;
-            expr = binOp;
         }
-        return input;
     }
 
-    const char *parsePrimary(const char *input, Expr *&node) {
-        while (*input && isspace(*input)) {
-            input++;
-        }
-        if (*input == '(') {
-            input++;
-            input = parseExpr(input, node);
-            if (!input || *input != ')') {
-                return nullptr;
-            }
-            return input + 1;
-        } else if (isAlpha(*input)) {
-            const char *rest = parseFunction(input, node);
-            if (rest) {
-                return rest;
-            }
-            return parseIdentifier(input, node);
-        }
-        return parseNumber(input, node);
-    }
-
-    const char *parseIdentifier(const char *input, Expr *&node) {
-        static const struct {
-            const char *name;
-            Var var;
-        } vars[] = {
-                {"t",   VAR_T},
-                {"i",   VAR_I},
-                {"x",   VAR_X},
-                {"y",   VAR_Y},
-                {"pi",  VAR_PI},
-                {"tau", VAR_TAU},
-        };
-
-        for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
-            size_t len = strlen(vars[i].name);
-            if (strncmp(input, vars[i].name, len) == 0) {
-                node = alloc(EXPR_VAR);
-                if (!node) {
-                    return nullptr;
-                }
-                node->var = vars[i].var;
-                return input + len;
-            }
-        }
+    static const char *invalid(const char *source, const Token &token) {
+        return isalpha((unsigned char) source[token.offset]) ? "Unknown name" : "Unexpected character";
+    }
 
+    Expr *fail(const char *message, const Token &token) {
+        fail(message, token.offset);
         return nullptr;
     }
 
-    const char *parseFunction(const char *input, Expr *&node) {
-        static const struct {
-            const char *name;
-            FuncType func;
-            size_t arity;
-        } funcs[]{
-                {"rand",   FUNC_RAND,   0},
-                {"random", FUNC_RANDOM, 0},
-                {"sin",    FUNC_SIN,    1},
-                {"cos",    FUNC_COS,    1},
-                {"tan",    FUNC_TAN,    1},
-                {"asin",   FUNC_ASIN,   1},
-                {"acos",   FUNC_ACOS,   1},
-                {"atan",   FUNC_ATAN,   1},
-                {"atan2",  FUNC_ATAN2,  2},
-                {"asinh",  FUNC_ASINH,  1},
-                {"acosh",  FUNC_ACOSH,  1},
-                {"atanh",  FUNC_ATANH,  1},
-                {"floor",  FUNC_FLOOR,  1},
-                {"ceil",   FUNC_CEIL,   1},
-                {"round",  FUNC_ROUND,  1},
-                {"fract",  FUNC_FRACT,  1},
-                {"hypot",  FUNC_HYPOT,  2}
-        };
-
-        for (size_t i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
-            size_t len = strlen(funcs[i].name);
-            if (strncmp(input, funcs[i].name, len) == 0 && input[len] == '(') {
-                node = alloc(EXPR_FUNC);
-                if (!node) {
-                    return nullptr;
-                }
-                node->funcCall.func = funcs[i].func;
-                node->funcCall.arity = funcs[i].arity;
-                input += len + 1;
-
-                for (size_t arg = 0; arg < funcs[i].arity; arg++) {
-                    if (arg > 0) {
-                        if (*input != ',') return nullptr;  // Error: missing comma between arguments
-                        input++;  // Skip comma
-                    }
-                    const char *nextInput = parseExpr(input, node->funcCall.args[arg]);
-                    if (!nextInput) { return nullptr; }
-
-                    if (arg == funcs[i].arity - 1 && *nextInput != ')') { return nullptr; }
-                    if (arg < funcs[i].arity - 1 && *nextInput != ',') { return nullptr; }
-
-                    input = nextInput;
-                }
-                return input + 1;
-            }
-        }
-
-        return nullptr;
+    bool fail(const char *message, size_t offset) {
+        parseError = message;
+        parseErrorOffset = offset;
+        return false;
     }
 
-    void printAST(Expr *node, int indent = 0) {
+    void printAST(const Expr *node, int indent = 0) {
         if (!node) return;
 
         for (int i = 0; i < indent; ++i) {
-            Serial.print("  ");
+            Platform::print("  ");
         }
 
         switch (node->type) {
             case EXPR_NUMBER:
-                Serial.print("Float: ");
-                Serial.println(node->number, 6);
+                Platform::print("Float: ");
+                Platform::println(node->number, 6);
                 break;
 
             case EXPR_BINOP:
-                Serial.print("BinOp: ");
-                switch (node->binop.op) {
+                Platform::print("BinOp: ");
+                switch (node->op) {
                     case BINOP_POW:
-                        Serial.println("POW");
+                        Platform::println("POW");
                         break;
                     case BINOP_MOD:
-                        Serial.println("MOD");
+                        Platform::println("MOD");
                         break;
                     case BINOP_ADD:
-                        Serial.println("ADD");
+                        Platform::println("ADD");
                         break;
                     case BINOP_SUB:
-                        Serial.println("SUB");
+                        Platform::println("SUB");
                         break;
                     case BINOP_MUL:
-                        Serial.println("MUL");
+                        Platform::println("MUL");
                         break;
                     case BINOP_DIV:
-                        Serial.println("DIV");
+                        Platform::println("DIV");
                         break;
                     case BINOP_LSHIFT:
-                        Serial.println("LSHIFT");
+                        Platform::println("LSHIFT");
                     case BINOP_RSHIFT:
-                        Serial.println("RSHIFT");
+                        Platform::println("RSHIFT");
                         break;
                     case BINOP_LTE:
-                        Serial.println("LTE");
+                        Platform::println("LTE");
                         break;
                     case BINOP_GTE:
-                        Serial.println("GTE");
+                        Platform::println("GTE");
                         break;
                     case BINOP_LT:
-                        Serial.println("LT");
+                        Platform::println("LT");
                         break;
                     case BINOP_GT:
-                        Serial.println("GT");
+                        Platform::println("GT");
                         break;
                     case BINOP_EQ:
-                        Serial.println("EQ");
+                        Platform::println("EQ");
                         break;
                     case BINOP_NEQ:
-                        Serial.println("NEQ");
+                        Platform::println("NEQ");
                         break;
                     case BINOP_OR:
-                        Serial.println("OR");
+                        Platform::println("OR");
                         break;
                     case BINOP_BIT_OR:
-                        Serial.println("BIT_OR");
+                        Platform::println("BIT_OR");
                         break;
                     case BINOP_AND:
-                        Serial.println("AND");
+                        Platform::println("AND");
                         break;
                     case BINOP_BIT_AND:
-                        Serial.println("BIT_AND");
+                        Platform::println("BIT_AND");
                         break;
                     case BINOP_BIT_XOR:
-                        Serial.println("BIT_XOR");
+                        Platform::println("BIT_XOR");
                         break;
                 }
-                printAST(node->binop.a, indent + 1);
-                printAST(node->binop.b, indent + 1);
+                printAST(at(node->args[0]), indent + 1);
+                printAST(at(node->args[1]), indent + 1);
                 break;
 
             case EXPR_VAR:
-                Serial.print("Var: ");
+                Platform::print("Var: ");
                 switch (node->var) {
                     case VAR_T:
-                        Serial.println("T");
+                        Platform::println("T");
                         break;
                     case VAR_I:
-                        Serial.println("I");
+                        Platform::println("I");
                         break;
                     case VAR_X:
-                        Serial.println("X");
+                        Platform::println("X");
                         break;
                     case VAR_Y:
-                        Serial.println("Y");
+                        Platform::println("Y");
                         break;
                     case VAR_PI:
-                        Serial.println("PI");
+                        Platform::println("PI");
                         break;
                     case VAR_TAU:
-                        Serial.println("TAU");
+                        Platform::println("TAU");
                         break;
                 }
                 break;
 
             case EXPR_FUNC:
-                Serial.print("Func: ");
-                switch (node->funcCall.func) {
+                Platform::print("Func: ");
+                switch (node->func) {
                     case FUNC_RAND:
                     case FUNC_RANDOM:
-                        Serial.println("RANDOM");
+                        Platform::println("RANDOM");
                         break;
                     case FUNC_SIN:
-                        Serial.println("SIN");
+                        Platform::println("SIN");
                         break;
                     case FUNC_COS:
-                        Serial.println("COS");
+                        Platform::println("COS");
                         break;
                     case FUNC_TAN:
-                        Serial.println("TAN");
+                        Platform::println("TAN");
                         break;
                     case FUNC_ASIN:
-                        Serial.println("ASIN");
+                        Platform::println("ASIN");
                         break;
                     case FUNC_ACOS:
-                        Serial.println("ACOS");
+                        Platform::println("ACOS");
                         break;
                     case FUNC_ATAN:
-                        Serial.println("ATAN");
+                        Platform::println("ATAN");
                         break;
                     case FUNC_ATAN2:
-                        Serial.println("ATAN2");
+                        Platform::println("ATAN2");
                         break;
                     case FUNC_ASINH:
-                        Serial.println("ASINH");
+                        Platform::println("ASINH");
                         break;
                     case FUNC_ACOSH:
-                        Serial.println("ACOSH");
+                        Platform::println("ACOSH");
                         break;
                     case FUNC_ATANH:
-                        Serial.println("ATANH");
+                        Platform::println("ATANH");
                         break;
                     case FUNC_FLOOR:
-                        Serial.println("FLOOR");
+                        Platform::println("FLOOR");
                         break;
                     case FUNC_CEIL:
-                        Serial.println("CEIL");
+                        Platform::println("CEIL");
                         break;
                     case FUNC_ROUND:
-                        Serial.println("ROUND");
+                        Platform::println("ROUND");
                         break;
                     case FUNC_FRACT:
-                        Serial.println("FRACT");
+                        Platform::println("FRACT");
                         break;
                     case FUNC_TRUNC:
-                        Serial.println("TRUNC");
+                        Platform::println("TRUNC");
                         break;
                     case FUNC_HYPOT:
-                        Serial.println("HYPOT");
+                        Platform::println("HYPOT");
                         break;
                 }
-                for (size_t i = 0; i < node->funcCall.arity; ++i) {
-                    printAST(node->funcCall.args[i], indent + 1);
+                for (size_t i = 0; i < node->arity; ++i) {
+                    printAST(at(node->args[i]), indent + 1);
                 }
                 break;
         }
@@ -0,0 +1,61 @@
+#pragma once
+
+// Everything the engine needs from the system it runs on. On Arduino this
+// forwards to Serial and random(), elsewhere to stdio and a small generator
+// of its own, so the engine can be built and benchmarked on the host.
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#endif
+
+#define PIXELFUN_PI 3.1415926535897932384626433832795
+
+struct Platform {
+#ifdef ARDUINO
+    static void print(const char *text) { Serial.print(text); }
+
+    static void println(const char *text) { Serial.println(text); }
+
+    static void println(float value, int digits) { Serial.println(value, digits); }
+
+    // Returns a random number in [0, max).
+    static long random(long max) { return ::random(max); }
+
+    // random() reads the hardware generator, which needs no seed and can be
+    // used from any task. Calling randomSeed() would replace it with rand().
+    static void seedRandom(uint32_t) {}
+#else
+    static void print(const char *text) { fputs(text, stdout); }
+
+    static void println(const char *text) { puts(text); }
+
+    static void println(float value, int digits) { printf("%.*f\n", digits, value); }
+
+    // Every thread has a generator of its own, so threads evaluating the
+    // same program neither contend for one nor race on it. Each starts out
+    // with the same seed until seedRandom() is called.
+    static long random(long max) { return max > 0 ? (long) (nextRandom() % (unsigned long) max) : 0; }
+
+    // Restarts the calling thread's generator.
+    static void seedRandom(uint32_t seed) { randomState() = seed ? seed : 1; }
+
+private:
+    static uint32_t &randomState() {
+        static thread_local uint32_t state = 2463534242u;
+        return state;
+    }
+
+    // Marsaglia's xorshift32.
+    static uint32_t nextRandom() {
+        uint32_t &state = randomState();
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+#endif
+};
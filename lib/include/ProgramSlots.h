@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+// Double buffers a program so a new one can be compiled while the current
+// one keeps rendering. New programs are compiled into the back slot and
+// published by swapping a pointer; the renderer picks the active program up
+// at the start of each frame and keeps it until endFrame().
+//
+// One thread renders and one thread updates. The renderer never waits. The
+// updater only has to wait while the renderer is still in a frame with the
+// program the back slot holds, which is at most one frame after a publish.
+template<typename Program>
+class ProgramSlots {
+public:
+    ProgramSlots() : active(&slots[0]), rendering(nullptr) {}
+
+    // Returns the program to render the next frame with.
+    Program &beginFrame() {
+        Program *program = active.load();
+        for (;;) {
+            // Announcing the program and checking it's still active makes
+            // sure back() can't hand it out in between.
+            rendering.store(program);
+            Program *current = active.load();
+            if (current == program) {
+                return *program;
+            }
+            program = current;
+        }
+    }
+
+    void endFrame() { rendering.store(nullptr); }
+
+    // Returns the active program. Only the updating thread may use it, for
+    // example to compile the very first program before rendering starts.
+    Program &current() { return *active.load(); }
+
+    // Returns the slot to compile the next program into, or nullptr while
+    // the renderer is still using it. A failed compile can simply be left
+    // there, the active program is not affected.
+    Program *back() {
+        Program *program = active.load() == &slots[0] ? &slots[1] : &slots[0];
+        return rendering.load() == program ? nullptr : program;
+    }
+
+    // Makes the program compiled into back() the active one.
+    void publish() { active.store(active.load() == &slots[0] ? &slots[1] : &slots[0]); }
+
+private:
+    Program slots[2];
+    std::atomic<Program *> active;
+    std::atomic<Program *> rendering;
+};
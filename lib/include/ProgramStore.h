@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "LittleEndian.h"
+#include "PixelFun.h"
+
+#ifndef ARDUINO
+#include <string>
+#endif
+
+#ifndef PIXELFUN_STORE_PROGRAMS
+#define PIXELFUN_STORE_PROGRAMS 16
+#endif
+
+// Largest encoded program the store keeps, the most a BLE attribute holds.
+#ifndef PIXELFUN_STORE_PROGRAM_BYTES
+#define PIXELFUN_STORE_PROGRAM_BYTES 512
+#endif
+
+// Persists small blobs under short keys, for example in NVS on the ESP32.
+class Storage {
+public:
+    virtual ~Storage() {}
+
+    // Reads the blob stored under key into data. Returns its size, or 0 if
+    // there is none or it is larger than capacity.
+    virtual size_t read(const char *key, uint8_t *data, size_t capacity) = 0;
+
+    virtual bool write(const char *key, const uint8_t *data, size_t size) = 0;
+};
+
+// How a program is shown, stored along with it.
+struct ProgramSettings {
+    uint8_t color1[3];
+    uint8_t color2[3];
+    uint8_t brightness;
+    uint8_t frameRate;
+};
+
+// Keeps up to PIXELFUN_STORE_PROGRAMS programs in their encoded form, so
+// they can be switched to and resumed at boot without parsing. Programs are
+// identified by the checksum in their encoding, a hash of their content, so
+// storing the same program twice keeps a single copy. When the store is
+// full the program stored first is replaced.
+//
+// Every program lives under its own key, "p0" to "p15", as an entry of a
+// sequence number, its settings and the encoded program. The ids of all
+// entries are read once by begin() and kept in RAM, so finding a program
+// never touches storage. "active" holds the id of the active program.
+class ProgramStore {
+public:
+    explicit ProgramStore(Storage &storage) : storage(storage), ids(), sequences(), sequence(0), activeId(0) {}
+
+    // Reads which programs are stored. Call this once before anything else.
+    void begin() {
+        for (size_t slot = 0; slot < PIXELFUN_STORE_PROGRAMS; slot++) {
+            size_t size = readEntry(slot);
+            if (size > entryHeaderSize + PROGRAM_HEADER_SIZE) {
+                ids[slot] = programId(entry + entryHeaderSize);
+                sequences[slot] = readLE32(entry);
+                if (sequences[slot] >= sequence) {
+                    sequence = sequences[slot] + 1;
+                }
+            }
+        }
+        uint8_t active[4];
+        if (storage.read("active", active, sizeof(active)) == sizeof(active)) {
+            activeId = readLE32(active);
+        }
+    }
+
+    // Id of the active program, 0 if there is none.
+    uint32_t active() const { return activeId; }
+
+    // Number of stored programs and their ids, for listing them.
+    size_t size() const {
+        size_t count = 0;
+        for (size_t slot = 0; slot < PIXELFUN_STORE_PROGRAMS; slot++) {
+            count += ids[slot] != 0;
+        }
+        return count;
+    }
+
+    // Writes the ids of all stored programs to out, which needs room for
+    // PIXELFUN_STORE_PROGRAMS of them, and returns how many there are.
+    size_t list(uint32_t *out) const {
+        size_t count = 0;
+        for (size_t slot = 0; slot < PIXELFUN_STORE_PROGRAMS; slot++) {
+            if (ids[slot]) {
+                out[count++] = ids[slot];
+            }
+        }
+        return count;
+    }
+
+    bool contains(uint32_t id) const { return find(id) < PIXELFUN_STORE_PROGRAMS; }
+
+    // The id a program produced by PixelFun::encode() is stored under: the
+    // checksum of its encoding, as 0 is reserved for no program.
+    static uint32_t programId(const uint8_t *encoded) {
+        uint32_t id = readLE32(encoded + 3);
+        return id ? id : 1;
+    }
+
+    // Stores a program produced by PixelFun::encode() with its settings and
+    // makes it the active one. Returns its id, or 0 if it is too large or
+    // couldn't be written.
+    uint32_t add(const uint8_t *encoded, size_t size, const ProgramSettings &settings) {
+        if (size <= PROGRAM_HEADER_SIZE || size > PIXELFUN_STORE_PROGRAM_BYTES) {
+            return 0;
+        }
+        uint32_t id = programId(encoded);
+        size_t slot = find(id);
+        if (slot == PIXELFUN_STORE_PROGRAMS) {
+            slot = oldest();
+        }
+
+        writeLE32(entry, sequence);
+        writeSettings(settings);
+        memcpy(entry + entryHeaderSize, encoded, size);
+        if (!storage.write(slotKey(slot), entry, entryHeaderSize + size)) {
+            return 0;
+        }
+        ids[slot] = id;
+        sequences[slot] = sequence++;
+        return activate(id) ? id : 0;
+    }
+
+    // Replaces the settings stored with a program.
+    bool update(uint32_t id, const ProgramSettings &settings) {
+        size_t slot = find(id);
+        if (slot == PIXELFUN_STORE_PROGRAMS) {
+            return false;
+        }
+        size_t size = readEntry(slot);
+        if (!size) {
+            return false;
+        }
+        writeSettings(settings);
+        return storage.write(slotKey(slot), entry, size);
+    }
+
+    // Installs the stored program id into program, fills in its settings
+    // and makes it the active one. Finding the program is a lookup in RAM,
+    // after which it takes one read and PixelFun::decode().
+    template<typename Program>
+    bool load(uint32_t id, Program &program, ProgramSettings &settings) {
+        size_t slot = find(id);
+        if (slot == PIXELFUN_STORE_PROGRAMS) {
+            return false;
+        }
+        size_t size = readEntry(slot);
+        if (size <= entryHeaderSize || !program.decode(entry + entryHeaderSize, size - entryHeaderSize)) {
+            return false;
+        }
+        readSettings(settings);
+        if (id != activeId) {
+            activate(id);
+        }
+        return true;
+    }
+
+    // Installs the program that was active when the device was last
+    // running, see load().
+    template<typename Program>
+    bool resume(Program &program, ProgramSettings &settings) {
+        return activeId && load(activeId, program, settings);
+    }
+
+private:
+    // Sequence number and settings in front of every encoded program.
+    static const size_t entryHeaderSize = 4 + sizeof(ProgramSettings);
+
+    Storage &storage;
+    uint32_t ids[PIXELFUN_STORE_PROGRAMS];
+    uint32_t sequences[PIXELFUN_STORE_PROGRAMS];
+    uint32_t sequence;
+    uint32_t activeId;
+    uint8_t entry[entryHeaderSize + PIXELFUN_STORE_PROGRAM_BYTES];
+    char key[8];
+
+    size_t find(uint32_t id) const {
+        for (size_t slot = 0; id && slot < PIXELFUN_STORE_PROGRAMS; slot++) {
+            if (ids[slot] == id) {
+                return slot;
+            }
+        }
+        return PIXELFUN_STORE_PROGRAMS;
+    }
+
+    // Returns a free slot, or the one holding the program stored first.
+    size_t oldest() const {
+        size_t oldest = 0;
+        for (size_t slot = 0; slot < PIXELFUN_STORE_PROGRAMS; slot++) {
+            if (!ids[slot]) {
+                return slot;
+            }
+            if (sequences[slot] < sequences[oldest]) {
+                oldest = slot;
+            }
+        }
+        return oldest;
+    }
+
+    bool activate(uint32_t id) {
+        uint8_t active[4];
+        writeLE32(active, id);
+        if (!storage.write("active", active, sizeof(active))) {
+            return false;
+        }
+        activeId = id;
+        return true;
+    }
+
+    size_t readEntry(size_t slot) { return storage.read(slotKey(slot), entry, sizeof(entry)); }
+
+    const char *slotKey(size_t slot) {
+        snprintf(key, sizeof(key), "p%u", (unsigned) slot);
+        return key;
+    }
+
+    void writeSettings(const ProgramSettings &settings) {
+        uint8_t *out = entry + 4;
+        memcpy(out, settings.color1, 3);
+        memcpy(out + 3, settings.color2, 3);
+        out[6] = settings.brightness;
+        out[7] = settings.frameRate;
+    }
+
+    void readSettings(ProgramSettings &settings) const {
+        const uint8_t *in = entry + 4;
+        memcpy(settings.color1, in, 3);
+        memcpy(settings.color2, in + 3, 3);
+        settings.brightness = in[6];
+        settings.frameRate = in[7];
+    }
+};
+
+#ifndef ARDUINO
+
+// Stands in for NVS on the host, keeping every key in a file of the same
+// name in directory, which has to exist. Files are replaced by renaming, so
+// an interrupted write leaves the previous contents.
+class FileStorage : public Storage {
+public:
+    explicit FileStorage(const char *directory) : directory(directory) {}
+
+    size_t read(const char *key, uint8_t *data, size_t capacity) override {
+        FILE *file = fopen(path(key).c_str(), "rb");
+        if (!file) {
+            return 0;
+        }
+        size_t size = fread(data, 1, capacity, file);
+        // A blob that fills capacity exactly may have been cut short.
+        bool complete = size < capacity || fgetc(file) == EOF;
+        fclose(file);
+        return complete ? size : 0;
+    }
+
+    bool write(const char *key, const uint8_t *data, size_t size) override {
+        std::string temporary = path(key) + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        bool written = fwrite(data, 1, size, file) == size;
+        written = fclose(file) == 0 && written;
+        return written && rename(temporary.c_str(), path(key).c_str()) == 0;
+    }
+
+private:
+    std::string directory;
+
+    std::string path(const char *key) const { return directory + "/" + key; }
+};
+
+#endif
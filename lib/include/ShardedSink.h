@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "FramePipeline.h"
+#include "WorkerPool.h"
+
+#ifndef PIXELFUN_MAX_CHANNELS
+#define PIXELFUN_MAX_CHANNELS 8
+#endif
+
+// What one output channel of a ShardedSink has done so far.
+struct ChannelStats {
+    uint64_t frames;
+    uint64_t pixels;
+    // Time spent in the channel's sink, in microseconds.
+    uint64_t busyMicros;
+    uint32_t lastMicros;
+};
+
+// Splits every frame across several sinks, each taking the next run of
+// pixels, and writes to all of them at once. A WS2812 line needs about
+// 30 us per pixel, so a large canvas on a single pin is limited by the
+// wire no matter how fast it renders; split across n pins it goes out n
+// times as fast.
+//
+// The first channel is written from the thread calling write(), every
+// other one from a thread of a WorkerPool. write() returns once all
+// channels are done with the frame, so it can be used like any other sink,
+// for example by FramePipeline::output().
+class ShardedSink : public FrameSink {
+public:
+    ShardedSink() : channelCount(0), pixelCount(0), frame(nullptr), frameSize(0) {}
+
+    // Adds a channel that takes the next count pixels of every frame.
+    // Channels have to be added before the first write(). Returns false if
+    // there are PIXELFUN_MAX_CHANNELS already.
+    bool addChannel(FrameSink &sink, size_t count) {
+        if (channelCount == PIXELFUN_MAX_CHANNELS) {
+            return false;
+        }
+        Channel &channel = channels[channelCount];
+        channel.sink = &sink;
+        channel.offset = pixelCount;
+        channel.count = count;
+        channel.stats = ChannelStats();
+        pixelCount += count;
+        if (channelCount > 0) {
+            pool.add();
+        }
+        channelCount++;
+        return true;
+    }
+
+    // Pixels past the last channel are dropped, channels past the end of
+    // the frame get fewer pixels or none.
+    void write(const uint8_t *pixels, size_t count) override {
+        if (channelCount == 0) {
+            return;
+        }
+        frame = pixels;
+        frameSize = count;
+        pool.run(&ShardedSink::writeChannel, this);
+    }
+
+    size_t size() const { return channelCount; }
+
+    // Only valid between calls to write(), on the thread making them.
+    const ChannelStats &stats(size_t channel) const { return channels[channel].stats; }
+
+private:
+    struct Channel {
+        FrameSink *sink;
+        size_t offset;
+        size_t count;
+        ChannelStats stats;
+    };
+
+    Channel channels[PIXELFUN_MAX_CHANNELS];
+    size_t channelCount;
+    size_t pixelCount;
+    // The frame being written, only changed between runs of the pool.
+    const uint8_t *frame;
+    size_t frameSize;
+    // Worker n writes channel n.
+    WorkerPool<PIXELFUN_MAX_CHANNELS> pool;
+
+    static void writeChannel(void *context, size_t index) {
+        static_cast<ShardedSink *>(context)->writeChannel(index);
+    }
+
+    void writeChannel(size_t index) {
+        Channel &channel = channels[index];
+        if (channel.offset >= frameSize) {
+            return;
+        }
+        size_t count = frameSize - channel.offset < channel.count ? frameSize - channel.offset : channel.count;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        channel.sink->write(frame + 3 * channel.offset, count);
+        uint32_t micros = (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+        channel.stats.frames++;
+        channel.stats.pixels += count;
+        channel.stats.busyMicros += micros;
+        channel.stats.lastMicros = micros;
+    }
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "WorkerPool.h"
+
+#ifndef PIXELFUN_TILE_SIZE
+#define PIXELFUN_TILE_SIZE 16
+#endif
+
+#ifndef PIXELFUN_MAX_WORKERS
+#define PIXELFUN_MAX_WORKERS 16
+#endif
+
+// What one worker of a TileRenderer has done so far.
+struct WorkerStats {
+    uint64_t frames;
+    uint64_t tiles;
+    // Tiles taken over from other workers.
+    uint64_t stolen;
+    // Time spent evaluating and looking for tiles, in microseconds.
+    uint64_t busyMicros;
+};
+
+// Evaluates frames of a program on several threads, for canvases too large
+// for one core. The canvas is cut into square tiles of tileSize pixels a
+// side, numbered row by row, and every worker starts out with an equal run
+// of them. How long a tile takes depends on the program and on where the
+// tile is, so a worker that is done with its own takes over the back half
+// of the run of the first worker it finds that still has some, until none
+// are left anywhere.
+//
+// Each worker's run is a single atomic word, its first and one past its
+// last tile, that the owner takes tiles off the front of and others steal
+// from the back of, both by compare and swap. Workers only ever read the
+// program, through PixelFun::evalTile(), so nothing is locked while a frame
+// is evaluated; starting it and waiting for it are left to a WorkerPool.
+//
+// The first worker runs on the thread calling render(), every other one on
+// a thread of the pool with its own random generator. The program must not
+// be parsed or decoded while render() runs. Programs calling rand() give a
+// different frame depending on which worker evaluated which tile.
+template<typename Program>
+class TileRenderer {
+public:
+    // Starts workers - 1 threads, at most PIXELFUN_MAX_WORKERS - 1.
+    explicit TileRenderer(size_t workers, size_t tileSize = PIXELFUN_TILE_SIZE)
+        : workerCount(workers < 1 ? 1 : workers > PIXELFUN_MAX_WORKERS ? PIXELFUN_MAX_WORKERS : workers),
+          tileSize(tileSize < 1 ? 1 : tileSize), job() {
+        for (size_t worker = 0; worker < workerCount; worker++) {
+            ranges[worker].value.store(0, std::memory_order_relaxed);
+            workerStats[worker] = WorkerStats();
+        }
+        for (size_t worker = 1; worker < workerCount; worker++) {
+            pool.add();
+        }
+    }
+
+    TileRenderer(const TileRenderer &) = delete;
+    TileRenderer &operator=(const TileRenderer &) = delete;
+
+    // Evaluates a whole frame into out, like program.evalFrame() does, as
+    // floats or quantized bytes. Returns once every tile is done.
+    template<typename T>
+    void render(const Program &program, float t, size_t width, size_t height, T *out) {
+        if (width == 0 || height == 0) {
+            return;
+        }
+        job.program = &program;
+        job.t = t;
+        job.width = width;
+        job.height = height;
+        job.out = out;
+        job.evaluate = &evaluate<T>;
+        // Tile numbers have to fit in half a word.
+        job.tileSize = tileSize;
+        while (tilesAcross(job.tileSize) * tilesDown(job.tileSize) > MAX_TILES) {
+            job.tileSize *= 2;
+        }
+        job.columns = tilesAcross(job.tileSize);
+        size_t tiles = job.columns * tilesDown(job.tileSize);
+        for (size_t worker = 0; worker < workerCount; worker++) {
+            ranges[worker].value.store(pack(tiles * worker / workerCount, tiles * (worker + 1) / workerCount),
+                                       std::memory_order_relaxed);
+        }
+        pool.run(&TileRenderer::work, this);
+    }
+
+    size_t size() const { return workerCount; }
+
+    // The workers update their stats while a frame renders, so read them
+    // from the thread calling render(), once it has returned.
+    const WorkerStats &stats(size_t worker) const { return workerStats[worker]; }
+
+private:
+    static const size_t MAX_TILES = 0xffff;
+
+    // The frame being rendered. Evaluates the tile at left, top of it.
+    struct Job {
+        const Program *program;
+        float t;
+        size_t width;
+        size_t height;
+        void *out;
+        void (*evaluate)(const Job &job, size_t left, size_t top, size_t width, size_t height);
+        size_t tileSize;
+        size_t columns;
+    };
+
+    // The tiles a worker has left, first << 16 | end. On a cache line of its
+    // own so owners taking tiles don't slow each other down.
+    struct Range {
+        std::atomic<uint32_t> value;
+        char padding[64 - sizeof(std::atomic<uint32_t>)];
+    };
+
+    size_t workerCount;
+    size_t tileSize;
+    Range ranges[PIXELFUN_MAX_WORKERS];
+    WorkerStats workerStats[PIXELFUN_MAX_WORKERS];
+    // Only changed between runs of the pool.
+    Job job;
+    WorkerPool<PIXELFUN_MAX_WORKERS> pool;
+
+    template<typename T>
+    static void evaluate(const Job &job, size_t left, size_t top, size_t width, size_t height) {
+        job.program->evalTile(job.t, job.width, left, top, width, height, static_cast<T *>(job.out));
+    }
+
+    static uint32_t pack(size_t first, size_t end) { return (uint32_t) (first << 16 | end); }
+
+    size_t tilesAcross(size_t size) const { return (job.width + size - 1) / size; }
+
+    size_t tilesDown(size_t size) const { return (job.height + size - 1) / size; }
+
+    static void work(void *context, size_t worker) { static_cast<TileRenderer *>(context)->work(worker); }
+
+    void work(size_t worker) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        WorkerStats &stats = workerStats[worker];
+        size_t tile;
+        for (;;) {
+            if (take(worker, tile)) {
+                size_t left = tile % job.columns * job.tileSize;
+                size_t top = tile / job.columns * job.tileSize;
+                size_t width = job.width - left < job.tileSize ? job.width - left : job.tileSize;
+                size_t height = job.height - top < job.tileSize ? job.height - top : job.tileSize;
+                job.evaluate(job, left, top, width, height);
+                stats.tiles++;
+            } else if (!steal(worker)) {
+                break;
+            }
+        }
+        stats.frames++;
+        stats.busyMicros += (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+    }
+
+    // Takes the first of the worker's own tiles.
+    bool take(size_t worker, size_t &tile) {
+        std::atomic<uint32_t> &range = ranges[worker].value;
+        uint32_t current = range.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t first = current >> 16;
+            uint32_t end = current & 0xffff;
+            if (first >= end) {
+                return false;
+            }
+            if (range.compare_exchange_weak(current, pack(first + 1, end), std::memory_order_relaxed)) {
+                tile = first;
+                return true;
+            }
+        }
+    }
+
+    // Moves the back half of another worker's tiles, the last one included,
+    // over to this worker, which has none left. Returns false if no worker
+    // had any.
+    bool steal(size_t worker) {
+        for (size_t n = 1; n < workerCount; n++) {
+            std::atomic<uint32_t> &range = ranges[(worker + n) % workerCount].value;
+            uint32_t current = range.load(std::memory_order_relaxed);
+            for (;;) {
+                uint32_t first = current >> 16;
+                uint32_t end = current & 0xffff;
+                if (first >= end) {
+                    break;
+                }
+                uint32_t middle = first + (end - first) / 2;
+                if (range.compare_exchange_weak(current, pack(first, middle), std::memory_order_relaxed)) {
+                    workerStats[worker].stolen += end - middle;
+                    ranges[worker].value.store(pack(middle, end), std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
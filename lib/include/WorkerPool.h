@@ -0,0 +1,107 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "Platform.h"
+
+// Threads that run the same task at once, one call of run() after the
+// other. Worker 0 is the thread calling run(), every other worker has a
+// thread of its own that sleeps until the next run(). Handing the task over
+// and waiting for it to be done take a mutex each; everything the task
+// does in between is up to it.
+//
+// Whatever the caller writes before run() is visible to every worker, and
+// whatever the workers write is visible to the caller once run() returns.
+// Every thread of the pool has a random generator of its own, seeded
+// differently, see Platform::seedRandom().
+template<size_t capacity>
+class WorkerPool {
+public:
+    typedef void (*Task)(void *context, size_t worker);
+
+    WorkerPool() : workerCount(1), task(nullptr), context(nullptr), generation(0), pending(0), stopping(false) {}
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        started.notify_all();
+        for (size_t worker = 1; worker < workerCount; worker++) {
+            threads[worker].join();
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Starts the thread of another worker. Returns false if there are
+    // capacity workers already. Not to be called while run() is.
+    bool add() {
+        if (workerCount == capacity) {
+            return false;
+        }
+        threads[workerCount] = std::thread(&WorkerPool::loop, this, workerCount, generation);
+        workerCount++;
+        return true;
+    }
+
+    // Number of workers, the calling thread included.
+    size_t size() const { return workerCount; }
+
+    // Calls task(context, worker) on every worker and returns once all of
+    // them are done.
+    void run(Task nextTask, void *nextContext) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = nextTask;
+            context = nextContext;
+            pending = workerCount - 1;
+            generation++;
+        }
+        started.notify_all();
+        nextTask(nextContext, 0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    std::thread threads[capacity];
+    size_t workerCount;
+
+    // The task being run and how many worker threads are still at it,
+    // guarded by mutex.
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    Task task;
+    void *context;
+    uint32_t generation;
+    size_t pending;
+    bool stopping;
+
+    // Starts out having done every run() before it was added.
+    void loop(size_t worker, uint32_t done) {
+        Platform::seedRandom((uint32_t) (worker * 2654435761u));
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            started.wait(lock, [this, done] { return stopping || generation != done; });
+            if (stopping) {
+                return;
+            }
+            done = generation;
+            Task current = task;
+            void *currentContext = context;
+            lock.unlock();
+            current(currentContext, worker);
+            lock.lock();
+            if (--pending == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+};
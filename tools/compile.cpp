@@ -0,0 +1,115 @@
+// Compiles a program into the binary format the firmware accepts on its
+// compiled program characteristic, or checks and prints a compiled one, for
+// example one read back from a device.
+//
+// Usage: pixelfun-compile [-x] [-o file] [--] [program]
+//        pixelfun-compile -d [file]
+//
+// The program is taken from the command line or read from stdin, and the
+// result is written to stdout unless -o names a file. Programs starting
+// with a minus, like -x/8, go after --. -x writes it as hex
+// instead of raw bytes. -d decodes a compiled program and prints its tree.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <PixelFun.h>
+
+#include "input.h"
+
+// Same capacity as the firmware, so everything compiled here fits there.
+static PixelFun<1024> program;
+
+static int usage() {
+    fputs("usage: pixelfun-compile [-x] [-o file] [--] [program]\n"
+          "       pixelfun-compile -d [file]\n",
+          stderr);
+    return 2;
+}
+
+static int decode(const char *path) {
+    FILE *in = path ? fopen(path, "rb") : stdin;
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    std::string data = readAll(in);
+    if (path) {
+        fclose(in);
+    }
+
+    if (!program.decode((const uint8_t *) data.data(), data.size())) {
+        fprintf(stderr, "byte %zu: %s\n", program.errorOffset(), program.error());
+        return 1;
+    }
+    printf("%zu bytes\n", data.size());
+    program.printAST();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    bool hex = false;
+    bool decoding = false;
+    const char *output = nullptr;
+    const char *source = nullptr;
+    bool options = true;
+    for (int i = 1; i < argc; i++) {
+        if (!options || argv[i][0] != '-' || argv[i][1] == '\0') {
+            if (source) {
+                return usage();
+            }
+            source = argv[i];
+        } else if (strcmp(argv[i], "--") == 0) {
+            options = false;
+        } else if (strcmp(argv[i], "-x") == 0) {
+            hex = true;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            decoding = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+    if (decoding) {
+        return decode(source);
+    }
+
+    std::string text = source ? source : readAll(stdin);
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) {
+        text.pop_back();
+    }
+    if (!program.parse(text.c_str())) {
+        fprintf(stderr, "%s\n%*s^ %s\n", text.c_str(), (int) program.errorOffset(), "", program.error());
+        return 1;
+    }
+
+    // A node takes at most 5 bytes, plus 3 for each operand it shares.
+    static uint8_t encoded[PROGRAM_HEADER_SIZE + 11 * 1024];
+    size_t size = program.encode(encoded, sizeof(encoded));
+    if (!size) {
+        fputs("encoding failed\n", stderr);
+        return 1;
+    }
+
+    FILE *out = output ? fopen(output, hex ? "w" : "wb") : stdout;
+    if (!out) {
+        perror(output);
+        return 1;
+    }
+    if (hex) {
+        for (size_t n = 0; n < size; n++) {
+            fprintf(out, "%02x", encoded[n]);
+        }
+        fputc('\n', out);
+    } else {
+        fwrite(encoded, 1, size, out);
+    }
+    if (output) {
+        fclose(out);
+    }
+    fprintf(stderr, "%zu bytes of text, %zu bytes compiled, %zu of %zu nodes left after optimizing\n", text.size(),
+            size, program.programNodes(), program.parsedNodes());
+    return 0;
+}
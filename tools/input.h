@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// Reads everything that is left of in, for programs passed on stdin.
+inline std::string readAll(FILE *in) {
+    std::string data;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        data.append(chunk, n);
+    }
+    return data;
+}
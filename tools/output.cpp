@@ -0,0 +1,101 @@
+// Renders a program to simulated WS2812 strips through a ShardedSink, to
+// check how a canvas is split across output channels and which frame rates
+// that allows before wiring up an installation.
+//
+// Usage: pixelfun-output [-s WIDTHxHEIGHT] [-c channels] [-f frames] [program]
+//
+// The canvas is 32x32 by default and split evenly across 4 channels, the
+// last one taking what is left over. Every channel is a SimulatedSink that
+// takes as long as the wire would. Afterwards the last frame each channel
+// received is compared with its part of the last rendered frame, and the
+// throughput of every channel is printed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <Palette.h>
+#include <PixelFun.h>
+#include <ShardedSink.h>
+
+static PixelFun<1024> program;
+
+static int usage() {
+    fputs("usage: pixelfun-output [-s WIDTHxHEIGHT] [-c channels] [-f frames] [program]\n", stderr);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    unsigned width = 32, height = 32;
+    size_t channels = 4;
+    size_t frames = 30;
+    const char *source = "sin(2*t-hypot(x-3.5,y-3.5))";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            channels = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            frames = strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else {
+            source = argv[i];
+        }
+    }
+    size_t pixels = (size_t) width * height;
+    if (channels == 0 || channels > PIXELFUN_MAX_CHANNELS || channels > pixels || frames == 0) {
+        return usage();
+    }
+    if (!program.parse(source)) {
+        fprintf(stderr, "%s\n%*s^ %s\n", source, (int) program.errorOffset(), "", program.error());
+        return 1;
+    }
+
+    const uint8_t color1[3] = {251, 72, 196};
+    const uint8_t color2[3] = {63, 255, 33};
+    Palette palette;
+    palette.setColors(color1, color2);
+
+    std::vector<SimulatedSink> strips(channels);
+    ShardedSink sink;
+    size_t share = pixels / channels;
+    for (size_t c = 0; c < channels; c++) {
+        sink.addChannel(strips[c], c + 1 < channels ? share : pixels - share * (channels - 1));
+    }
+
+    std::vector<uint8_t> values(pixels);
+    std::vector<uint8_t> frame(3 * pixels);
+    double renderSeconds = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames; f++) {
+        std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+        program.evalFrame(f / 60.0f, width, height, values.data());
+        palette.apply(values.data(), pixels, frame.data());
+        renderSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+        sink.write(frame.data(), pixels);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool ok = true;
+    size_t offset = 0;
+    printf("%ux%u, %zu channels, %zu frames\n", width, height, channels, frames);
+    for (size_t c = 0; c < channels; c++) {
+        const ChannelStats &stats = sink.stats(c);
+        size_t count = stats.pixels / stats.frames;
+        bool same = strips[c].frameCount() == frames &&
+                    memcmp(strips[c].lastFrame(), frame.data() + 3 * offset, 3 * count) == 0;
+        ok = ok && same;
+        printf("channel %zu: pixels %5zu-%-5zu %8.0f us/frame %7.1f fps max %9.0f pixels/s %s\n", c, offset,
+               offset + count - 1, (double) stats.busyMicros / stats.frames, 1e6 * stats.frames / stats.busyMicros,
+               1e6 * stats.pixels / stats.busyMicros, same ? "ok" : "MISMATCH");
+        offset += count;
+    }
+    printf("render %.0f us/frame, %.1f fps overall, %.1f fps on a single channel\n", renderSeconds * 1e6 / frames,
+           frames / seconds, 1e6 / (30.0 * pixels + 80));
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+// Checks that programs with numbers the fixed-point backend can't represent
+// are rejected where the number comes from, be it a literal, a constant the
+// parser folds or a record of a compiled program, and that the float
+// backend takes them all.
+//
+// Usage: pixelfun-range
+//
+// Every case is printed; the exit status is 1 if any of them failed.
+
+#include <cstdio>
+#include <cstring>
+
+#include <PixelFun.h>
+
+static PixelFun<1024, FixedBackend> fixed;
+static PixelFun<1024> floating;
+
+struct Case {
+    const char *source;
+    // Byte offset of the number, operator or call that is out of range, -1
+    // if the program fits.
+    int offset;
+};
+
+static const Case cases[] = {
+    {"x*32767", -1},
+    {"x*40000", 2},
+    {"-0.5*x-32767", -1},
+    {"x-1e5", 2},
+    {"100*300+x", -1},
+    {"100*1000", 3},
+    {"x+2**20", 3},
+    {"2**20/2**10", 1},
+    {"sin(x)*(pi*20000)", 10},
+    {"hypot(30000,30000)+x", 0},
+    {"x+1/1e-5", 3},
+};
+
+int main() {
+    bool ok = true;
+    for (const Case &c : cases) {
+        bool parsed = fixed.parse(c.source);
+        bool passed = c.offset < 0 ? parsed
+                                   : !parsed && strcmp(fixed.error(), "Number out of range") == 0 &&
+                                         fixed.errorOffset() == (size_t) c.offset;
+        passed = passed && floating.parse(c.source);
+        ok = ok && passed;
+        char expected[32];
+        if (c.offset < 0) {
+            strcpy(expected, "fits");
+        } else {
+            snprintf(expected, sizeof(expected), "out of range at %d", c.offset);
+        }
+        printf("%-24s %-20s %s\n", c.source, expected, passed ? "ok" : "FAILED");
+    }
+
+    // Compiled programs come from clients, which may use either backend.
+    uint8_t encoded[64];
+    size_t size = floating.parse("x*40000") ? floating.encode(encoded, sizeof(encoded)) : 0;
+    bool passed = size && !fixed.decode(encoded, size) && strcmp(fixed.error(), "Number out of range") == 0;
+    ok = ok && passed;
+    printf("%-24s %-20s %s\n", "x*40000 compiled", "out of range", passed ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
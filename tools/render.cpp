@@ -0,0 +1,306 @@
+// Renders a program off-device, at the size of a real installation, to see
+// how it looks and how fast it runs before sending it to one.
+//
+// Usage: pixelfun-render [-s WIDTHxHEIGHT] [-f frames] [-r fps] [-1 RRGGBB] [-2 RRGGBB]
+//                        [-b backend] [-F ppm|raw] [-o file] [--] [program]
+//
+// The canvas is 8x8 by default and can be anything up to 256x256. Frame n
+// is rendered at t = n / fps, 60 frames at 60 fps unless -f and -r say
+// otherwise, and colored with PixelFun::interpolateColors() from the two
+// colors, the firmware's defaults unless -1 and -2 give others. -b picks
+// the backend: scalar, scalar-approx, vector or fixed.
+//
+// Frames are written to file as they are rendered, so only one is ever held
+// in memory. With -F ppm, the default, every frame is a binary PPM image,
+// with -F raw just its r, g, b bytes. All frames go into the one file, "-"
+// being stdout, unless its name contains a %. Then it has to contain
+// exactly one %d, optionally with a width as in frame%04d.ppm, which is
+// replaced by the frame number to give every frame a file of its own; %%
+// stands for a % of its own. Without -o nothing is written, which measures
+// rendering alone. The program is taken from the command line, after -- if
+// it starts with a minus, or read from stdin. Throughput is reported on
+// stderr.
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <PixelFun.h>
+
+#include "input.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    unsigned width;
+    unsigned height;
+    unsigned long frames;
+    double fps;
+    uint8_t color1[3];
+    uint8_t color2[3];
+    bool raw;
+    const char *output;
+};
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static int usage() {
+    fputs("usage: pixelfun-render [-s WIDTHxHEIGHT] [-f frames] [-r fps] [-1 RRGGBB] [-2 RRGGBB]\n"
+          "                       [-b scalar|scalar-approx|vector|fixed] [-F ppm|raw] [-o file] [--] [program]\n",
+          stderr);
+    return 2;
+}
+
+static bool parseColor(const char *text, uint8_t color[3]) {
+    char *end;
+    unsigned long value = strtoul(text, &end, 16);
+    if (strlen(text) != 6 || *end != '\0') {
+        return false;
+    }
+    color[0] = (uint8_t) (value >> 16);
+    color[1] = (uint8_t) (value >> 8);
+    color[2] = (uint8_t) value;
+    return true;
+}
+
+// Sets path to the name of frame's file: pattern with its %d replaced by
+// the frame number, padded to the width of %4d or %04d, and %% by %.
+// Returns false unless there is exactly one %d and no other conversion.
+static bool framePath(const char *pattern, unsigned long frame, std::string &path) {
+    path.clear();
+    size_t conversions = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '%') {
+            path += *p;
+            continue;
+        }
+        if (*++p == '%') {
+            path += '%';
+            continue;
+        }
+        bool zero = *p == '0';
+        int width = 0;
+        while (isdigit((unsigned char) *p) && width < 100) {
+            width = width * 10 + (*p++ - '0');
+        }
+        if (*p != 'd') {
+            return false;
+        }
+        char number[128];
+        snprintf(number, sizeof(number), zero ? "%0*lu" : "%*lu", width, frame);
+        path += number;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Writes frames to one file or one file per frame, see the usage above.
+class FrameWriter {
+public:
+    explicit FrameWriter(const Options &options) : options(options), file(nullptr), perFrame(false) {}
+
+    ~FrameWriter() { close(); }
+
+    bool open() {
+        if (!options.output) {
+            return true;
+        }
+        perFrame = strchr(options.output, '%') != nullptr;
+        if (perFrame) {
+            return true;
+        }
+        file = strcmp(options.output, "-") == 0 ? stdout : fopen(options.output, "wb");
+        return file != nullptr;
+    }
+
+    bool write(unsigned long frame, const uint8_t *rgb, size_t size) {
+        if (!options.output) {
+            return true;
+        }
+        if (perFrame) {
+            std::string path;
+            framePath(options.output, frame, path);
+            file = fopen(path.c_str(), "wb");
+            if (!file) {
+                perror(path.c_str());
+                return false;
+            }
+        }
+        bool written = true;
+        if (!options.raw) {
+            written = fprintf(file, "P6\n%u %u\n255\n", options.width, options.height) > 0;
+        }
+        written = written && fwrite(rgb, 1, size, file) == size;
+        if (perFrame) {
+            written = fclose(file) == 0 && written;
+            file = nullptr;
+        }
+        return written;
+    }
+
+    bool close() {
+        bool closed = true;
+        if (file && file != stdout) {
+            closed = fclose(file) == 0;
+        } else if (file) {
+            closed = fflush(file) == 0;
+        }
+        file = nullptr;
+        return closed;
+    }
+
+private:
+    const Options &options;
+    FILE *file;
+    bool perFrame;
+};
+
+template<typename Backend>
+static int render(const char *source, const char *backendName, const Options &options) {
+    static PixelFun<1024, Backend> program;
+    size_t pixels = (size_t) options.width * options.height;
+    if (pixels > program.maxPixels()) {
+        fprintf(stderr, "%s renders at most %zu pixels\n", backendName, program.maxPixels());
+        return 2;
+    }
+    if (!program.parse(source)) {
+        fprintf(stderr, "%s\n%*s^ %s\n", source, (int) program.errorOffset(), "", program.error());
+        return 1;
+    }
+
+    FrameWriter writer(options);
+    if (!writer.open()) {
+        perror(options.output);
+        return 1;
+    }
+
+    std::vector<float> values(pixels);
+    std::vector<uint8_t> rgb(3 * pixels);
+    uint8_t color1[3];
+    uint8_t color2[3];
+    memcpy(color1, options.color1, 3);
+    memcpy(color2, options.color2, 3);
+
+    double evalSeconds = 0;
+    double colorSeconds = 0;
+    double writeSeconds = 0;
+    Clock::time_point start = Clock::now();
+    for (unsigned long frame = 0; frame < options.frames; frame++) {
+        Clock::time_point evalStart = Clock::now();
+        program.evalFrame((float) (frame / options.fps), options.width, options.height, values.data());
+        evalSeconds += secondsSince(evalStart);
+
+        Clock::time_point colorStart = Clock::now();
+        for (size_t n = 0; n < pixels; n++) {
+            std::tie(rgb[3 * n], rgb[3 * n + 1], rgb[3 * n + 2]) =
+                program.interpolateColors(color1, color2, values[n]);
+        }
+        colorSeconds += secondsSince(colorStart);
+
+        Clock::time_point writeStart = Clock::now();
+        if (!writer.write(frame, rgb.data(), rgb.size())) {
+            perror(options.output);
+            return 1;
+        }
+        writeSeconds += secondsSince(writeStart);
+    }
+    Clock::time_point closeStart = Clock::now();
+    if (!writer.close()) {
+        perror(options.output);
+        return 1;
+    }
+    writeSeconds += secondsSince(closeStart);
+    double seconds = secondsSince(start);
+
+    double frames = (double) options.frames;
+    fprintf(stderr, "%ux%u, %lu frames at %g fps, %s, %zu nodes\n", options.width, options.height, options.frames,
+            options.fps, backendName, program.programNodes());
+    fprintf(stderr, "eval %.1f us/frame (%.2f ns/px), color %.1f us/frame, write %.1f us/frame\n",
+            evalSeconds * 1e6 / frames, evalSeconds * 1e9 / (frames * pixels), colorSeconds * 1e6 / frames,
+            writeSeconds * 1e6 / frames);
+    fprintf(stderr, "%.1f fps, %.2f Mpixels/s, %.1fx real time\n", frames / seconds, frames * pixels / seconds / 1e6,
+            frames / options.fps / seconds);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options options = {8, 8, 60, 60, {251, 72, 196}, {63, 255, 33}, false, nullptr};
+    const char *backend = "scalar";
+    const char *source = nullptr;
+    bool flags = true;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (!flags || argv[i][0] != '-' || argv[i][1] == '\0') {
+            if (source) {
+                return usage();
+            }
+            source = argv[i];
+        } else if (strcmp(argv[i], "--") == 0) {
+            flags = false;
+        } else if (strcmp(argv[i], "-s") == 0 && hasValue) {
+            if (sscanf(argv[++i], "%ux%u", &options.width, &options.height) != 2) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && hasValue) {
+            options.frames = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && hasValue) {
+            options.fps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-1") == 0 && hasValue) {
+            if (!parseColor(argv[++i], options.color1)) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-2") == 0 && hasValue) {
+            if (!parseColor(argv[++i], options.color2)) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-b") == 0 && hasValue) {
+            backend = argv[++i];
+        } else if (strcmp(argv[i], "-F") == 0 && hasValue) {
+            const char *format = argv[++i];
+            if (strcmp(format, "ppm") != 0 && strcmp(format, "raw") != 0) {
+                return usage();
+            }
+            options.raw = strcmp(format, "raw") == 0;
+        } else if (strcmp(argv[i], "-o") == 0 && hasValue) {
+            options.output = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+    std::string path;
+    if (options.output && strchr(options.output, '%') && !framePath(options.output, 0, path)) {
+        return usage();
+    }
+    if (options.width < 1 || options.width > 256 || options.height < 1 || options.height > 256 ||
+        options.frames == 0 || !(options.fps > 0)) {
+        return usage();
+    }
+
+    std::string text = source ? source : readAll(stdin);
+    // So errors point into a single line.
+    while (!text.empty() && isspace((unsigned char) text.back())) {
+        text.pop_back();
+    }
+    if (strcmp(backend, "scalar") == 0) {
+        return render<ScalarBackend<> >(text.c_str(), backend, options);
+    }
+    if (strcmp(backend, "scalar-approx") == 0) {
+        return render<ScalarBackend<ApproxMath> >(text.c_str(), backend, options);
+    }
+#if defined(__GNUC__)
+    if (strcmp(backend, "vector") == 0) {
+        return render<VectorBackend<> >(text.c_str(), backend, options);
+    }
+#endif
+    if (strcmp(backend, "fixed") == 0) {
+        return render<FixedBackend>(text.c_str(), backend, options);
+    }
+    return usage();
+}
@@ -0,0 +1,107 @@
+// Renders a large canvas with a TileRenderer on 1 up to N workers, to see
+// how evaluation scales with the number of cores.
+//
+// Usage: pixelfun-scale [-s WIDTHxHEIGHT] [-w workers] [-t tile] [-f frames] [program]
+//
+// The canvas is 512x512 by default and N the number of cores the host has
+// unless -w says otherwise. For every worker count the frames are rendered
+// once, and the last one is compared with what evalFrame() gives on a single
+// thread. Programs whose frames differ from one run to the next, like ones
+// calling rand(), can't be compared and are reported as such. Speedup and
+// efficiency are relative to a single worker.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <PixelFun.h>
+#include <TileRenderer.h>
+
+typedef PixelFun<1024> Program;
+
+static Program program;
+
+static int usage() {
+    fputs("usage: pixelfun-scale [-s WIDTHxHEIGHT] [-w workers] [-t tile] [-f frames] [program]\n", stderr);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    unsigned width = 512, height = 512;
+    size_t workers = std::thread::hardware_concurrency();
+    size_t tileSize = PIXELFUN_TILE_SIZE;
+    size_t frames = 20;
+    const char *source = "sin(2*t-hypot(x-255.5,y-255.5)/8)*cos(x/32+sin(t+y/16))";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workers = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tileSize = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            frames = strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else {
+            source = argv[i];
+        }
+    }
+    if (workers == 0) {
+        workers = 1;
+    }
+    if (workers > PIXELFUN_MAX_WORKERS || tileSize == 0 || frames == 0) {
+        return usage();
+    }
+    if (!program.parse(source)) {
+        fprintf(stderr, "%s\n%*s^ %s\n", source, (int) program.errorOffset(), "", program.error());
+        return 1;
+    }
+
+    size_t pixels = (size_t) width * height;
+    float last = (frames - 1) / 60.0f;
+    std::vector<float> expected(pixels);
+    std::vector<float> again(pixels);
+    program.evalFrame(last, width, height, expected.data());
+    program.evalFrame(last, width, height, again.data());
+    bool comparable = memcmp(expected.data(), again.data(), pixels * sizeof(float)) == 0;
+
+    printf("%ux%u, %zux%zu tiles, %zu frames, %zu nodes\n", width, height, tileSize, tileSize, frames,
+           program.programNodes());
+    bool ok = true;
+    double single = 0;
+    std::vector<float> values(pixels);
+    for (size_t count = 1; count <= workers; count++) {
+        TileRenderer<Program> renderer(count, tileSize);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t f = 0; f < frames; f++) {
+            renderer.render(program, f / 60.0f, width, height, values.data());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (count == 1) {
+            single = seconds;
+        }
+
+        uint64_t stolen = 0;
+        for (size_t worker = 0; worker < count; worker++) {
+            stolen += renderer.stats(worker).stolen;
+        }
+        const char *check = "not comparable";
+        if (comparable) {
+            bool same = memcmp(values.data(), expected.data(), pixels * sizeof(float)) == 0;
+            ok = ok && same;
+            check = same ? "ok" : "MISMATCH";
+        }
+        printf("%2zu workers: %8.2f ms/frame %6.2f Mpixels/s speedup %5.2fx efficiency %4.0f%% stolen %6.1f "
+               "tiles/frame %s\n",
+               count, seconds * 1e3 / frames, frames * pixels / seconds / 1e6, single / seconds,
+               100 * single / seconds / count, (double) stolen / frames, check);
+    }
+    printf("%u cores\n", std::thread::hardware_concurrency());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+// Runs a ProgramStore on FileStorage, the host stand-in for NVS, through
+// what the firmware does with it: storing more programs than fit, switching
+// between them and resuming after a restart.
+//
+// Usage: pixelfun-store [directory]
+//
+// The store is kept in directory, which has to exist, or in a new one under
+// /tmp that is left behind for inspection. Every step is checked and
+// printed; the exit status is 1 if any of them failed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <PixelFun.h>
+#include <ProgramStore.h>
+
+typedef PixelFun<1024> Program;
+
+static const size_t programCount = PIXELFUN_STORE_PROGRAMS + 4;
+
+static Program program;
+static Program expected;
+static uint8_t encoded[programCount][PIXELFUN_STORE_PROGRAM_BYTES];
+static size_t sizes[programCount];
+static uint32_t ids[programCount];
+static bool ok = true;
+
+static void check(bool passed, const char *what) {
+    printf("%-50s %s\n", what, passed ? "ok" : "FAILED");
+    ok = ok && passed;
+}
+
+static ProgramSettings settingsFor(size_t n) {
+    ProgramSettings settings = {{(uint8_t) n, 0, 0}, {0, (uint8_t) n, 0}, (uint8_t) (n * 10), (uint8_t) (30 + n)};
+    return settings;
+}
+
+static bool sameSettings(const ProgramSettings &a, const ProgramSettings &b) {
+    return memcmp(a.color1, b.color1, 3) == 0 && memcmp(a.color2, b.color2, 3) == 0 &&
+           a.brightness == b.brightness && a.frameRate == b.frameRate;
+}
+
+// Whether the installed program renders like source n.
+static bool renders(size_t n) {
+    char source[64];
+    snprintf(source, sizeof(source), "sin(x*%zu+t)-y/%zu", n + 1, n + 2);
+    expected.parse(source);
+    float a[64], b[64];
+    program.evalFrame(1.5f, 8, 8, a);
+    expected.evalFrame(1.5f, 8, 8, b);
+    return memcmp(a, b, sizeof(a)) == 0;
+}
+
+// The id of source n parsed once more, the way the firmware identifies its
+// default effect after a restart.
+static uint32_t parsedId(size_t n) {
+    char source[64];
+    snprintf(source, sizeof(source), "sin(x*%zu+t)-y/%zu", n + 1, n + 2);
+    uint8_t buffer[PIXELFUN_STORE_PROGRAM_BYTES];
+    size_t size = expected.parse(source) ? expected.encode(buffer, sizeof(buffer)) : 0;
+    return size ? ProgramStore::programId(buffer) : 0;
+}
+
+// Whether exactly the programs from first on are stored.
+static bool holds(const ProgramStore &store, size_t first) {
+    if (store.size() != programCount - first) {
+        return false;
+    }
+    for (size_t n = 0; n < programCount; n++) {
+        if (store.contains(ids[n]) != (n >= first)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    char temporary[] = "/tmp/pixelfun-store-XXXXXX";
+    const char *directory = argc > 1 ? argv[1] : mkdtemp(temporary);
+    if (!directory || argc > 2) {
+        fputs("usage: pixelfun-store [directory]\n", stderr);
+        return 2;
+    }
+    printf("store in %s, %d programs of up to %d bytes\n", directory, PIXELFUN_STORE_PROGRAMS,
+           PIXELFUN_STORE_PROGRAM_BYTES);
+
+    for (size_t n = 0; n < programCount; n++) {
+        char source[64];
+        snprintf(source, sizeof(source), "sin(x*%zu+t)-y/%zu", n + 1, n + 2);
+        if (!program.parse(source) || !(sizes[n] = program.encode(encoded[n], sizeof(encoded[n])))) {
+            fprintf(stderr, "%s: %s\n", source, program.error());
+            return 1;
+        }
+    }
+
+    FileStorage storage(directory);
+    {
+        ProgramStore store(storage);
+        store.begin();
+        check(store.size() == 0 && store.active() == 0, "starts out empty");
+
+        bool added = true;
+        for (size_t n = 0; n < programCount; n++) {
+            ids[n] = store.add(encoded[n], sizes[n], settingsFor(n));
+            added = added && ids[n] != 0 && store.active() == ids[n];
+        }
+        check(added, "adds every program and activates it");
+        check(holds(store, programCount - PIXELFUN_STORE_PROGRAMS), "evicts the programs stored first");
+
+        size_t count = store.size();
+        check(store.add(encoded[programCount - 1], sizes[programCount - 1], settingsFor(programCount - 1)) ==
+                      ids[programCount - 1] &&
+                  store.size() == count,
+              "keeps a single copy of a program added twice");
+
+        ProgramSettings settings;
+        size_t middle = programCount - 3;
+        check(store.load(ids[middle], program, settings) && store.active() == ids[middle] && renders(middle) &&
+                  sameSettings(settings, settingsFor(middle)),
+              "switches to a stored program by id");
+        check(!store.load(ids[0], program, settings), "can't switch to an evicted program");
+        check(store.update(ids[middle], settingsFor(0)), "updates the settings of a program");
+    }
+
+    {
+        ProgramStore store(storage);
+        store.begin();
+        size_t middle = programCount - 3;
+        check(holds(store, programCount - PIXELFUN_STORE_PROGRAMS), "finds the same programs after a restart");
+
+        ProgramSettings settings;
+        check(store.active() == ids[middle] && store.resume(program, settings) && renders(middle) &&
+                  sameSettings(settings, settingsFor(0)),
+              "resumes the active program with its settings");
+        check(store.active() == parsedId(middle), "knows the active program by the id of its source");
+
+        // The sequence numbers survive the restart, so the next program
+        // still replaces the oldest one.
+        size_t oldest = programCount - PIXELFUN_STORE_PROGRAMS;
+        check(store.add(encoded[0], sizes[0], settingsFor(0)) == ids[0] && !store.contains(ids[oldest]) &&
+                  store.contains(ids[oldest + 1]) && store.size() == PIXELFUN_STORE_PROGRAMS,
+              "evicts the oldest program after a restart");
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+// Checks that Palette and WireFormat produce the exact bytes the firmware
+// used to send, when it colored pixels in plain r, g, b and handed them to
+// Adafruit_NeoPixel::setPixelColor() after setBrightness().
+//
+// Usage: pixelfun-wire
+//
+// NeoPixelBuffer below is a copy of what the Adafruit_NeoPixel library does
+// to its pixel buffer, everything but sending it. Every strip color order,
+// every brightness, every channel value and both kinds of palette are
+// compared; the exit status is 1 if any byte differs.
+
+#include <cstdio>
+#include <cstring>
+
+#include <Palette.h>
+
+// Color orders as Adafruit_NeoPixel.h defines them: the offsets of white,
+// red, green and blue, two bits each.
+static const uint16_t NEO_RGB = (0 << 6) | (0 << 4) | (1 << 2) | 2;
+static const uint16_t NEO_RBG = (0 << 6) | (0 << 4) | (2 << 2) | 1;
+static const uint16_t NEO_GRB = (1 << 6) | (1 << 4) | (0 << 2) | 2;
+static const uint16_t NEO_GBR = (2 << 6) | (2 << 4) | (0 << 2) | 1;
+static const uint16_t NEO_BRG = (1 << 6) | (1 << 4) | (2 << 2) | 0;
+static const uint16_t NEO_BGR = (2 << 6) | (2 << 4) | (1 << 2) | 0;
+
+// Adafruit_NeoPixel's updateType(), setBrightness() and setPixelColor()
+// for strips with 3 bytes per pixel.
+class NeoPixelBuffer {
+public:
+    explicit NeoPixelBuffer(uint16_t type)
+        : brightness(0), rOffset((type >> 4) & 3), gOffset((type >> 2) & 3), bOffset(type & 3), pixels() {}
+
+    void setBrightness(uint8_t b) {
+        uint8_t newBrightness = b + 1;
+        if (newBrightness != brightness) {
+            uint8_t oldBrightness = brightness - 1;
+            uint16_t scale;
+            if (oldBrightness == 0) {
+                scale = 0;
+            } else if (b == 255) {
+                scale = 65535 / oldBrightness;
+            } else {
+                scale = (((uint16_t) newBrightness << 8) - 1) / oldBrightness;
+            }
+            for (size_t i = 0; i < sizeof(pixels); i++) {
+                pixels[i] = (pixels[i] * scale) >> 8;
+            }
+            brightness = newBrightness;
+        }
+    }
+
+    void setPixelColor(size_t n, uint8_t r, uint8_t g, uint8_t b) {
+        if (brightness) {
+            r = (r * brightness) >> 8;
+            g = (g * brightness) >> 8;
+            b = (b * brightness) >> 8;
+        }
+        uint8_t *p = &pixels[n * 3];
+        p[rOffset] = r;
+        p[gOffset] = g;
+        p[bOffset] = b;
+    }
+
+    const uint8_t *getPixels() const { return pixels; }
+
+private:
+    uint8_t brightness;
+    uint8_t rOffset;
+    uint8_t gOffset;
+    uint8_t bOffset;
+    uint8_t pixels[3 * 256];
+};
+
+struct ColorOrder {
+    const char *name;
+    uint16_t type;
+};
+
+static const ColorOrder orders[] = {{"RGB", NEO_RGB}, {"RBG", NEO_RBG}, {"GRB", NEO_GRB},
+                                    {"GBR", NEO_GBR}, {"BRG", NEO_BRG}, {"BGR", NEO_BGR}};
+
+// Every value of every channel, with the other two running the other way
+// and half as fast.
+static bool sameEncoding(uint16_t type, uint8_t brightness) {
+    NeoPixelBuffer strip(type);
+    strip.setBrightness(brightness);
+    WireFormat format = WireFormat::neoPixel(type, brightness);
+    uint8_t encoded[3 * 256];
+    for (size_t v = 0; v < 256; v++) {
+        uint8_t r = (uint8_t) v, g = (uint8_t) (255 - v), b = (uint8_t) (v / 2);
+        strip.setPixelColor(v, r, g, b);
+        format.encode(r, g, b, encoded + 3 * v);
+    }
+    return memcmp(strip.getPixels(), encoded, sizeof(encoded)) == 0;
+}
+
+// The palette built in wire format against the plain one sent through the
+// strip, for all 256 values.
+static bool samePalette(const Palette &plain, Palette &wire, uint16_t type, uint8_t brightness) {
+    NeoPixelBuffer strip(type);
+    strip.setBrightness(brightness);
+    uint8_t values[256];
+    uint8_t encoded[3 * 256];
+    for (size_t v = 0; v < 256; v++) {
+        values[v] = (uint8_t) v;
+        strip.setPixelColor(v, plain[(uint8_t) v][0], plain[(uint8_t) v][1], plain[(uint8_t) v][2]);
+    }
+    wire.apply(values, 256, encoded);
+    return memcmp(strip.getPixels(), encoded, sizeof(encoded)) == 0;
+}
+
+int main() {
+    const uint8_t color1[3] = {251, 72, 196};
+    const uint8_t color2[3] = {63, 255, 33};
+    const PaletteStop stops[] = {{0, {255, 0, 0}}, {64, {255, 255, 0}}, {128, {0, 0, 0}}, {200, {0, 128, 255}},
+                                 {255, {255, 255, 255}}};
+    const size_t stopCount = sizeof(stops) / sizeof(stops[0]);
+
+    Palette plainColors, plainGradient;
+    plainColors.setColors(color1, color2);
+    plainGradient.setGradient(stops, stopCount);
+
+    bool ok = true;
+    for (const ColorOrder &order : orders) {
+        size_t encodings = 0, colors = 0, gradients = 0;
+        for (unsigned brightness = 0; brightness < 256; brightness++) {
+            Palette wire;
+            wire.setOutput(WireFormat::neoPixel(order.type, (uint8_t) brightness));
+            wire.setColors(color1, color2);
+            colors += samePalette(plainColors, wire, order.type, (uint8_t) brightness);
+            wire.setGradient(stops, stopCount);
+            gradients += samePalette(plainGradient, wire, order.type, (uint8_t) brightness);
+            encodings += sameEncoding(order.type, (uint8_t) brightness);
+        }
+        bool same = encodings == 256 && colors == 256 && gradients == 256;
+        ok = ok && same;
+        printf("%s: %3zu/256 brightnesses encode alike, two colors %3zu/256, gradient %3zu/256 %s\n", order.name,
+               encodings, colors, gradients, same ? "ok" : "MISMATCH");
+    }
+    return ok ? 0 : 1;
+}